@@ -23,12 +23,23 @@
 //------------------------------------------------
 // Standard libraries
 //------------------------------------------------
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <unordered_map>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <string>
 #include <string.h>
+#include <thread>
 #include "expat.h"
 #include "zlib.h"
 #include "MSNumpress.hpp"
@@ -112,6 +123,12 @@ typedef off_t f_off;
 #define __inline__ inline
 #endif
 
+//SSE2 is part of every x86-64 target
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MZP_SSE2
+#endif
+
 // this define should work for most LINUX and UNIX platforms
 
 
@@ -125,6 +142,24 @@ typedef struct specDP{
 	double intensity;
 } specDP;
 
+//Storage precision of BasicSpectrum data points. The float modes keep the
+//spectrum in columns, halving (or nearly) its memory.
+enum enumPrecision {
+	precDouble=0,					//m/z and intensity as double
+	precFloatIntensity,		//double m/z, float intensity
+	precFloat							//float m/z and intensity; ~0.1 ppm m/z rounding
+};
+
+//Binary arrays of a spectrum, as bits of the mask given to setArrays(). Arrays left
+//out of the mask are passed over unread, and their column of the spectrum is zero.
+enum enumArray {
+	arrayMZ=1,
+	arrayIntensity=2,
+	arrayIonMobility=4,		//any of the ion mobility arrays
+	arrayOther=8,					//charge, signal to noise, non-standard and other arrays
+	arrayAll=0xffff
+};
+
 typedef struct TimeIntensityPair{
 	double time;
 	double intensity;
@@ -139,6 +174,40 @@ enum enumActivation {
 	ECD=5,
 };
 
+//mzML elements acted upon by mzpSAXMzmlHandler. Element names are mapped
+//to these codes with a perfect hash so that SAX events dispatch by switch.
+enum enumMzMLElement {
+	mzmlOther=0,
+	mzmlBinary,
+	mzmlBinaryDataArray,
+	mzmlBinaryDataArrayList,
+	mzmlChromatogram,
+	mzmlChromatogramList,
+	mzmlComponentList,
+	mzmlCvParam,
+	mzmlIndex,
+	mzmlIndexedmzML,
+	mzmlIndexList,
+	mzmlOffset,
+	mzmlPrecursor,
+	mzmlPrecursorList,
+	mzmlReferenceableParamGroup,
+	mzmlReferenceableParamGroupRef,
+	mzmlRun,
+	mzmlSoftwareParam,
+	mzmlSpectrum,
+	mzmlSpectrumList,
+	mzmlUserParam
+};
+
+//cvParam accessions are reduced to integer codes: the numeric part of the
+//accession for the PSI-MS (MS:) ontology, and the same OR'ed with MZP_CV_UO
+//for the unit (UO:) ontology. Zero means no recognizable accession.
+#define MZP_CV_UO 0x40000000
+
+//File name extension of the binary index sidecar written next to mzML and mzXML files
+#define MZP_INDEX_CACHE_EXT ".mzpidx"
+
 
 
 //------------------------------------------------
@@ -152,6 +221,84 @@ public:
 	f_off offset;
 };
 
+//One entry of an mzpIndex, as returned by its operator[] and iterators. idRef points
+//into the index's pool and is valid until the index is next changed. Code written
+//for cindex can take a copy, which owns its idRef string.
+class cindexRef	{
+public:
+	operator cindex() const;
+
+	int					scanNum;
+	const char*	idRef;
+	f_off				offset;
+};
+
+//A spectrum or chromatogram index stored column by column: scan numbers, offsets,
+//and every idRef in a single pool, so that a large run needs no allocation per entry.
+//It is read like a vector<cindex>, with entries returned as cindexRef.
+class mzpIndex	{
+public:
+
+	//Read-only iterator over the entries, e.g. for(const cindexRef& c : index)
+	class const_iterator	{
+	public:
+		typedef forward_iterator_tag	iterator_category;
+		typedef cindexRef							value_type;
+		typedef ptrdiff_t							difference_type;
+		typedef const cindexRef*			pointer;
+		typedef cindexRef							reference;
+
+		const_iterator(const mzpIndex* x, size_t i);
+		cindexRef				operator*() const;
+		const_iterator&	operator++();
+		const_iterator	operator++(int);
+		bool						operator==(const const_iterator& it) const;
+		bool						operator!=(const const_iterator& it) const;
+
+	private:
+		const mzpIndex*	index;
+		size_t					pos;
+	};
+
+	//Operator overloads
+	cindexRef operator[ ](const size_t i) const;
+
+	//Modifiers
+	void clear();
+	void push_back(const cindex& c);
+	void push_back(const cindexRef& c);
+	void push_back(int scan, f_off off, const char* id, size_t len);
+	void reserve(size_t n, size_t poolSize=0);
+
+	//Accessors
+	cindexRef				at(const size_t i) const;		//throws out_of_range, as vector::at()
+	cindexRef				back() const;
+	const_iterator	begin() const;
+	bool						empty() const;
+	const_iterator	end() const;
+	size_t					size() const;
+
+	//Data Members, one entry per row
+	vector<f_off>			offset;
+	vector<int>				scanNum;
+	vector<uint32_t>	idPos;		//start of each idRef in pool
+	string						pool;			//idRefs, each ending in '\0'
+
+};
+
+//Hash and equality of '\0'-terminated strings, for maps keyed by pointers into an
+//mzpIndex pool rather than by copies of each idRef.
+struct mzpStrHash {
+	size_t operator()(const char* s) const {
+		size_t h=2166136261u;
+		for(;*s;s++) h=(h^(unsigned char)*s)*16777619u;
+		return h;
+	}
+};
+struct mzpStrEqual {
+	bool operator()(const char* a, const char* b) const { return strcmp(a,b)==0; }
+};
+
 //For instrument information
 class instrumentInfo {
 public:
@@ -179,6 +326,40 @@ public:
 	}
 };
 
+//One encoded mzML <binaryDataArray>: the base64 text of its <binary> element and
+//the settings needed to turn it into values. Kept by BasicSpectrum until the
+//array is first read.
+class mzpBinaryArray	{
+public:
+
+	//Constructors & Destructors
+	mzpBinaryArray();
+
+	//Modifiers
+	void clear();
+	void swap(mzpBinaryArray& a);
+
+	//Accessors
+	void decode(vector<double>& d) const;
+	void decode(vector<float>& f) const;		//32-bit arrays are copied without widening
+	bool empty() const;
+
+	//Data Members
+	string	data;							//base64 text
+	int			dataType;					//0=unspecified, 1=32-bit float, 2=64-bit float, 3=32-bit integer, 4=64-bit integer
+	long		encodedLength;
+	bool		numpressLinear;
+	bool		numpressPic;
+	bool		numpressSlof;
+	int			peaksCount;
+	bool		zlib;
+
+private:
+	char* unpack(size_t& len) const;
+	static uint32_t dtohl(uint32_t l);
+	static uint64_t dtohl(uint64_t l);
+};
+
 class BasicSpectrum	{
 public:
 
@@ -189,14 +370,16 @@ public:
 
 	//Operator overloads
 	BasicSpectrum& operator=(const BasicSpectrum& s);
-	specDP& operator[ ](const unsigned int index);
+	specDP operator[ ](const unsigned int index);	//a copy; use addDP() and clear() to modify
 
 	//Modifiers
+	void addArray(const char* name, mzpBinaryArray& a);	//takes an extra array, decoded on first access
 	void addDP(specDP dp);
 	void clear();
 	void setActivation(int a);
 	void setBasePeakIntensity(double d);
 	void setBasePeakMZ(double d);
+	void setBinaryData(mzpBinaryArray& mz, mzpBinaryArray& intensity);	//takes both arrays, decoded on first access
 	void setCentroid(bool b);
 	void setCollisionEnergy(double d);
 	void setCompensationVoltage(double d);
@@ -205,8 +388,10 @@ public:
 	void setIDString(char* str);
 	void setLowMZ(double d);
 	void setMSLevel(int level);
+	void setPeakStats(double tic, double bpMZ, double bpIntensity, double lowMZ, double highMZ);	//fills in those the file did not report
 	void setPeaksCount(int i);
 	void setPositiveScan(bool b);
+	void setPrecision(int p);		//enumPrecision; converts any data already held
 	void setPrecursorCharge(int z);
 	void setPrecursorIntensity(double d);
   void setPrecursorMonoMZ(double mz);
@@ -218,7 +403,11 @@ public:
 	void setTotalIonCurrent(double d);
 
 	//Accessors
+	int						findArray(const char* name);		//extra array by name, or -1
 	int						getActivation();
+	vector<double>&	getArray(int a);								//values of extra array a, one per data point
+	int						getArrayCount();
+	const char*		getArrayName(int a);
 	double				getBasePeakIntensity();
 	double				getBasePeakMZ();
 	bool					getCentroid();
@@ -227,10 +416,13 @@ public:
 	int					  getFilterLine(char* str);
 	double				getHighMZ();
 	int						getIDString(char* str);
+	double				getIntensity(const unsigned int index);	//decodes only the intensity array
 	double				getLowMZ();
 	int						getMSLevel();
+	double				getMZ(const unsigned int index);				//decodes only the m/z array
 	int						getPeaksCount();
 	bool					getPositiveScan();
+	int						getPrecision();
 	int						getPrecursorCharge();
 	double				getPrecursorIntensity();
   double        getPrecursorMonoMZ();
@@ -258,6 +450,7 @@ protected:
 	int							msLevel;
 	int							peaksCount;
 	bool						positiveScan;
+	int							precision;						//enumPrecision
 	int							precursorCharge;			//Precursor ion charge; 0 if no precursor or unknown
 	double					precursorIntensity;		//Precursor ion intensity; 0 if no precursor or unknown
   double          precursorMonoMZ;      //Might be reported in Thermo data
@@ -266,11 +459,62 @@ protected:
 	float						rTime;								//always stored in minutes
 	int							scanIndex;						//when scan numbers aren't enough, there are indexes (start at 1)
 	int							scanNum;							//identifying scan number
+	bool						statsPending;					//peak statistics wait on decoding binMZ and binIntensity
 	double					totalIonCurrent;
-	vector<specDP>	vData;								//Spectrum data points
+	vector<specDP>	vData;								//Spectrum data points (precDouble)
+	vector<double>	vMZ;									//m/z column (precFloatIntensity)
+	vector<float>		vMZ32;								//m/z column (precFloat)
+	vector<float>		vIntensity32;					//intensity column (float modes)
+	mzpBinaryArray	binIntensity;					//encoded arrays not yet decoded
+	mzpBinaryArray	binMZ;
+
+	//extra arrays (ion mobility, charge...), in file order
+	vector<mzpBinaryArray>		binArray;		//encoded until first read
+	vector<vector<double> >		vArray;
+	vector<string>						vArrayName;
+
+	void decodeIntensity();
+	void decodeMZ();
+	void decodeStats();
+	void gatherStats();
+	void matchColumns();
 	   
 };
 
+//Running TIC, base peak, and m/z extent of the peaks added to it, shared by the
+//decoding loops that fill BasicSpectrum::setPeakStats().
+class mzpPeakStats	{
+public:
+
+	//Constructors & Destructors
+	mzpPeakStats();
+
+	//Modifiers
+	void	add(double mz, double intensity);
+	void	store(BasicSpectrum& s) const;	//passes the statistics to s, if any peaks were added
+
+	//Data Members
+	size_t	count;
+	double	tic;
+	double	bpMZ;
+	double	bpIntensity;
+	double	lowMZ;
+	double	highMZ;
+
+};
+
+//called once per decoded point, so kept inline
+inline void mzpPeakStats::add(double mz, double intensity){
+	tic+=intensity;
+	if(count==0 || intensity>bpIntensity) {
+		bpIntensity=intensity;
+		bpMZ=mz;
+	}
+	if(count==0 || mz<lowMZ) lowMZ=mz;
+	if(count==0 || mz>highMZ) highMZ=mz;
+	count++;
+}
+
 class BasicChromatogram	{
 public:
 
@@ -301,12 +545,146 @@ protected:
 	   
 };
 
+//Spectrum headers for a whole run, stored column by column in index order
+class mzpHeaderTable	{
+public:
+
+	//Modifiers
+	void clear();
+	void getRow(int row, BasicSpectrum& s);		//copies a row into the header fields of s
+	void resize(int n);
+	void setRow(int row, BasicSpectrum& s, f_off off);
+
+	//Accessors
+	int		size();
+
+	//Data Members (columns)
+	vector<int>			activation;
+	vector<double>	basePeakIntensity;
+	vector<double>	basePeakMZ;
+	vector<bool>		centroid;
+	vector<double>	collisionEnergy;
+	vector<double>	compensationVoltage;
+	vector<string>	filterLine;
+	vector<double>	highMZ;
+	vector<string>	idString;
+	vector<double>	lowMZ;
+	vector<int>			msLevel;
+	vector<f_off>		offset;
+	vector<int>			peaksCount;
+	vector<bool>		positiveScan;
+	vector<int>			precursorCharge;
+	vector<double>	precursorIntensity;
+	vector<double>	precursorMonoMZ;
+	vector<double>	precursorMZ;
+	vector<int>			precursorScanNum;
+	vector<float>		rTime;								//minutes
+	vector<int>			scanNum;
+	vector<double>	totalIonCurrent;
+
+};
+
+//Conditions for MzParser::readSpectrum(filter). Limits of 0 (-1 for activation) are not applied.
+class mzpSpectrumFilter	{
+public:
+
+	//Constructors & Destructors
+	mzpSpectrumFilter();
+
+	//Accessors
+	bool	pass(int level, float rt, double precursor, int act) const;
+
+	//Data Members
+	int			activation;				//enumActivation value
+	int			msLevelHigh;
+	int			msLevelLow;
+	double	precursorMZHigh;	//a precursor limit rejects spectra without a precursor
+	double	precursorMZLow;
+	float		rTimeHigh;				//minutes
+	float		rTimeLow;					//minutes
+
+};
+
+//Selects the most intense peaks of a spectrum as it is decoded: the topN of the whole
+//spectrum, or of every m/z window. A cutoff is found per range by selection rather
+//than sorting, so kept peaks stay in their original order.
+class mzpTopPeaks	{
+public:
+
+	//Constructors & Destructors
+	mzpTopPeaks();
+
+	//Modifiers
+	void	compact(vector<double>& v) const;	//drops the points of v not kept by select()
+	void	select(const vector<double>& mz, const vector<double>& intensity);
+
+	//Accessors
+	bool	active() const;
+
+	//Data Members
+	vector<char>	keep;			//1 for each point kept by select()
+	int						topN;			//0 keeps every peak
+	double				window;		//m/z width of each window, or 0 for the whole spectrum
+
+private:
+	void	selectRange(const vector<double>& intensity, size_t first, size_t last);
+
+	vector<double>	work;
+
+};
+
+//Reduces a profile spectrum to centroids as it is decoded. Each local intensity maximum
+//becomes one peak, at the apex of the parabola through it and its two neighbors.
+//Maxima are flagged first, two points at a time with SSE2 where available, and only
+//the flagged points are then interpolated.
+class mzpCentroider	{
+public:
+
+	//Modifiers
+	void	centroid(vector<double>& mz, vector<double>& intensity);	//replaces the profile points with centroids
+	void	compact(vector<double>& v) const;		//keeps the values of v at each centroid's maximum
+
+private:
+
+	//Data Members
+	vector<size_t>				vApex;			//profile position of each centroid
+	vector<unsigned char>	vMax;				//1 at each local maximum
+	size_t								profileSize;
+
+};
+
+//Receives each spectrum of a whole-file pass; returning false ends the pass.
+typedef bool (*mzpSpectrumCallback)(BasicSpectrum& s, void* data);
+
+//Extracted ion chromatograms: the intensity summed within a ppm tolerance of each
+//target m/z, one point per MS1 spectrum. The targets are sorted once, and each
+//spectrum is matched against all of them in a single merge over its peaks.
+class mzpXIC	{
+public:
+
+	//Constructors & Destructors
+	//xics is resized to one chromatogram per target, each holding a zero point per retention time
+	mzpXIC(const vector<double>& mz, double ppm, vector<BasicChromatogram>& xics, const vector<float>& rTimes);
+
+	//Modifiers
+	void	addSpectrum(int row, BasicSpectrum& s);	//spectra of different rows may be added concurrently
+
+private:
+
+	//Data Members, in target m/z order
+	vector<double>							vHigh;
+	vector<double>							vLow;
+	vector<TimeIntensityPair*>	vOut;		//points of each target's chromatogram
+
+};
+
 //------------------------------------------------
 // Random access gz (zran from zlib source code)
 //------------------------------------------------
 #define SPAN 1048576L       // desired distance between access points
 #define WINSIZE 32768U      // sliding window size
 #define CHUNK 32768         // file input buffer size
+#define MAXSPAN 0x8000000   // largest element length taken from an index to size a read
 #define READCHUNK 16384
 
 // access point entry 
@@ -337,10 +715,12 @@ public:
 	int extract(FILE *in, f_off offset, unsigned char *buf, int len);
 	int extract(FILE *in, f_off offset);
 	f_off getfilesize();
+	void share_index(const Czran& c);
 
 protected:
 private:
 	gz_access* index;
+	bool bSharedIndex;	//index belongs to another Czran
 	
 	unsigned char* buffer;
 	f_off bufferOffset;
@@ -362,6 +742,40 @@ private:
 
 int b64_decode_mio (char *dest, char *src, size_t size);
 
+#define MZP_PIPE_SLOTS 8			// buffers in the parse() decompression ring
+#define MZP_PIPE_BUF 262144		// bytes per ring buffer
+#define MZP_PIPE_SPIN 1024		// polls of an empty or full ring before sleeping
+
+//Single-producer, single-consumer ring between the decompression and parsing
+//threads of parse(). A slot belongs to the producer until head passes it, then
+//to the consumer until tail does. A side that finds the ring empty or full
+//sleeps on cv; lock is only taken to sleep and to wake a sleeper.
+typedef struct mzpPipeRing{
+	char*									buf[MZP_PIPE_SLOTS];
+	int										len[MZP_PIPE_SLOTS];	// 0 marks the end of the file
+	atomic<unsigned int>	head;								// slots filled
+	atomic<unsigned int>	tail;								// slots parsed
+	atomic<bool>					cancel;							// parsing has stopped
+	atomic<int>						sleepers;						// threads waiting on cv
+	mutex									lock;
+	condition_variable		cv;
+} mzpPipeRing;
+
+#define MZP_QUEUE_BLOCK 64	// consecutive spectra per block in decodeAll()
+
+//Bounded queue of decoded blocks between the workers of decodeAll() and its caller.
+//Block b is decoded into slot b%slots, once the block that held the slot before it
+//has been delivered.
+typedef struct mzpSpectrumQueue{
+	vector<vector<BasicSpectrum> >	slot;
+	vector<int>											block;	// block decoded into each slot, or -1
+	int															done;		// blocks delivered
+	atomic<int>											next;		// next block to claim
+	bool														cancel;	// the caller has stopped
+	mutex														lock;
+	condition_variable							cv;
+} mzpSpectrumQueue;
+
 class mzpSAXHandler{
 public:
 
@@ -376,9 +790,11 @@ public:
 
 	//  SAXHandler Parsing functions.
 	bool open(const char* fileName);
+	bool openShared(const mzpSAXHandler& h);
 	bool parse();
-	bool parseOffset(f_off offset);
+	bool parseOffset(f_off offset, int len=0);
 	void setGZCompression(bool b);
+	void setIndexCache(bool b);
 
 	inline void setFileName(const char* fileName) {
 		m_strFileName = fileName;
@@ -400,6 +816,15 @@ public:
 
 protected:
 
+	//  SAXHandler raw file access, independent of MZGF, gz, or plain file
+	static int	indexSpan(const mzpIndex& v, int pos, f_off end=0);
+	bool	parsePipe();
+	void	pipeFill(mzpPipeRing* r);
+	int		readFile(char* buf, int len);
+	bool	readIndexCache(mzpIndex& vSpec, mzpIndex& vChromat, f_off& offset);
+	void	seekFile(f_off offset);
+	bool	writeIndexCache(const mzpIndex& vSpec, const mzpIndex& vChromat, f_off offset);
+
 	XML_Parser m_parser;
 	string  m_strFileName;
 	bool m_bStopParse;
@@ -407,6 +832,8 @@ protected:
 	FILE* fptr;
 	Czran gzObj;
 	MZGFile::MZGFileReader *mzgf;
+	f_off m_fileOffset;		//uncompressed position of the next readFile()
+	bool m_bIndexCache;		//read and write the binary index sidecar
 
 };
 
@@ -422,18 +849,32 @@ public:
 	void characters(const XML_Char *s, int len);
 
 	//  SAXMzmlHandler public functions
-	vector<cindex>*					getChromatIndex();
+	bool										decodeAll(mzpSpectrumCallback fn, void* data, int threads=0);	//every spectrum, in index order
+	bool										decodeSpectra(const vector<int>& pos, vector<BasicSpectrum>& specs, int threads=0);
+	bool										extractXIC(const vector<double>& mz, double ppm, vector<BasicChromatogram>& xics, int threads=0);
+	int											findIdRef(const char* idRef);	//index position of a nativeID, or -1
+	int											findScan(int scanNum);				//index position of a scan number, or -1
+	mzpIndex*								getChromatIndex();	//entries are cindexRef: idRef is a const char*, not a string
+	mzpHeaderTable*					getHeaderTable();			//empty until scanHeaders()
 	f_off										getIndexOffset();
 	vector<instrumentInfo>*	getInstrument();
 	int											getPeaksCount();
-	vector<cindex>*					getSpecIndex();
+	mzpIndex*								getSpecIndex();				//entries are cindexRef: idRef is a const char*, not a string
 	int											highChromat();
 	int											highScan();
 	bool										load(const char* fileName);
 	int											lowScan();
 	bool										readChromatogram(int num=-1);
 	bool										readHeader(int num=-1);
+	bool										readSpectra(const vector<int>& scans, vector<BasicSpectrum>& specs);
 	bool										readSpectrum(int num=-1);
+	bool										readSpectrum(const mzpSpectrumFilter& f);	//next spectrum passing f
+	bool										scanHeaders();								//read all headers into memory in one pass
+	void										setArrays(int mask);					//enumArray bits of the spectrum arrays to read (default arrayAll)
+	void										setCentroiding(bool b);				//reduce profile spectra to centroids as they are decoded (default off)
+	void										setLazyDecode(bool b);				//defer binary decoding to BasicSpectrum (default on)
+	void										setTopPeaks(int n, double window=0);	//keep the n most intense peaks, per m/z window if window>0
+	bool										streamAll(mzpSpectrumCallback fn, void* data);	//every spectrum, in one sequential pass
 	
 protected:
 
@@ -448,24 +889,39 @@ private:
 		string value;
 		string unitAccession;
 		string unitName;
+		int		 cvCode;
+		int		 unitCode;
 	};
 
 	//  mzpSAXMzmlHandler private functions
+	static int	cvCode(const char* accession, const char* name=NULL);
+	static int	elementCode(const XML_Char* el);
 	void	processData();
-	void	processCVParam(const char* name, const char* accession, const char* value, const char* unitName="0", const char* unitAccession="0");
+	void	processCVParam(int code, const char* name, const char* value, int unitCode=0);
 	void	pushChromatogram();
 	void	pushSpectrum();	// Load current data into pvSpec, may have to guess charge
+	bool	buildIndex();
+	bool	addHeaderRow(f_off offset);
+	void	buildLookup();
+	void	cancelScan(int scanSPECCount, int scanPRECCount);
+	int		chromatogramSpan(int pos) const;
+	void	clearWorkers();
+	void	decodeAllShare(const mzpSAXMzmlHandler* parent, mzpSpectrumQueue* q);
+	void	decodeShare(const mzpSAXMzmlHandler* parent, const vector<int>* pos, const vector<int>* order, vector<BasicSpectrum>* specs, atomic<int>* next, atomic<bool>* ok);
+	bool	fillScanBuf(char*& p, char*& end, f_off& bufOffset);
+	void	indexRange(f_off start, f_off stop, mzpIndex* vSpec, mzpIndex* vChromat);
 	f_off readIndexOffset();
+	void	scanBlock(const mzpSAXMzmlHandler* parent, int first, int last, vector<BasicSpectrum>& out);
+	bool	scanSpectrum(f_off offset, int specLen=0);
+	bool	scanSpectrumText(char* p, char* end);
+	int		scanTags(char** pp, char* end);
+	int		spectrumSpan(int pos, bool header=false) const;
+	void	sortOffsetOrder();
+	int		startWorkers(int threads);
 	void	stopParser();
-
-	//  mzpSAXMzmlHandler Base64 conversion functions
-  void decode(vector<double>& d);
-	//void decode32(vector<double>& d);
-	//void decode64(vector<double>& d);
-	//void decompress32(vector<double>& d);
-	//void decompress64(vector<double>& d);
-	unsigned long dtohl(uint32_t l, bool bNet);
-	uint64_t dtohl(uint64_t l, bool bNet);
+	bool	streamRow(f_off offset);
+	bool	streamSpectra(f_off start, bool (mzpSAXMzmlHandler::*fn)(f_off offset));
+	void	xicShare(const mzpSAXMzmlHandler* parent, const vector<int>* pos, mzpXIC* xic, atomic<int>* next);
 
 	//  mzpSAXMzmlHandler Flags indicating parser is inside a particular tag.
 	bool m_bInIndexedMzML;
@@ -475,32 +931,56 @@ private:
 	bool m_bInSpectrumList;
 	bool m_bInChromatogramList;
 	bool m_bInIndexList;
+	bool m_bInChromatogram;
 
 	//  mzpSAXMzmlHandler procedural flags.
+	bool m_bCentroid;		// centroid profile spectra, set by setCentroiding()
 	bool m_bChromatogramIndex;
 	bool m_bHeaderOnly;
+	bool m_bLazyDecode;
 	bool m_bLowPrecision;
 	bool m_bNetworkData;	// i.e. big endian
   bool m_bNumpressLinear;
   bool m_bNumpressPic;
   bool m_bNumpressSlof;
 	bool m_bNoIndex;
+	bool m_bSkipBinary;	// the current array is not in m_iArrays
 	bool m_bSpectrumIndex;
   bool m_bZlib;
-  int  m_iDataType;   //0=unspecified, 1=32-bit float, 2=64-bit float
+  int  m_iArrays;     //enumArray mask of spectrum arrays to read
+  int  m_iDataType;   //0=unspecified, 1=32-bit float, 2=64-bit float, 3=32-bit integer, 4=64-bit integer
+  int  m_iExtraArray; //enumArray bit of the current extra array, or 0
 	
 	//  mzpSAXMzmlHandler index data members.
-	vector<cindex>		m_vIndex;
-	cindex						curIndex;
+	mzpIndex					m_vIndex;
 	int								posIndex;
 	f_off							indexOffset;
 
-	vector<cindex>		m_vChromatIndex;
-	cindex						curChromatIndex;
+	mzpIndex					m_vChromatIndex;
 	int								posChromatIndex;
 
+	//  mzpSAXMzmlHandler lookup tables into m_vIndex, built by buildLookup()
+	vector<int>									m_vScanPos;		// position of scan (m_iLowScan+i), or -1
+	unordered_map<int,int>			m_mScanPos;		// used instead of m_vScanPos when scan numbers are sparse
+	unordered_map<const char*,int,mzpStrHash,mzpStrEqual>	m_mIdRefPos;	// keys point into m_vIndex.pool
+	int													m_iLowScan;
+	int													m_iHighScan;
+
+	//  mzpSAXMzmlHandler headers of all spectra, filled by scanHeaders()
+	mzpHeaderTable							m_headerTable;
+	vector<int>									m_vOffsetOrder;	// index positions in file order
+	int													m_iStreamRow;		// next position in m_vOffsetOrder while streaming
+	mzpSpectrumCallback					m_streamFn;			// streamAll() callback, NULL once it has stopped
+	void*												m_streamData;
+
+	//  mzpSAXMzmlHandler handlers reading the same file for decodeAll(), decodeSpectra() and extractXIC()
+	vector<mzpSAXMzmlHandler*>	m_vWorkers;
+
 	//  mzpSAXMzmlHandler data members.
 	BasicChromatogram*			chromat;
+	mzpBinaryArray					m_binIntensity;					// Encoded arrays of the current element
+	mzpBinaryArray					m_binMZ;
+	string									m_strArrayName;					// Name of the current extra array
 	string									m_ccurrentRefGroupName;
 	long										m_encodedLen;					  // For compressed data
 	instrumentInfo					m_instrument;
@@ -514,8 +994,12 @@ private:
 	string									m_strData;							// For collecting character data.
 	vector<instrumentInfo>	m_vInstrument;
 	BasicSpectrum*					spec;
+	mzpCentroider						m_centroider;
+	mzpTopPeaks							m_topPeaks;							// Decode-time peak selection, set by setTopPeaks()
 	vector<double>					vdI;
 	vector<double>					vdM;										// Peak list vectors (masses and charges)
+	char*										m_scanBuf;							// Raw spectrum text for scanSpectrum()
+	int											m_scanBufSize;
 
 };
 
@@ -531,7 +1015,7 @@ public:
 	void characters(const XML_Char *s, int len);
 
 	//  mzpSAXMzxmlHandler public functions
-	vector<cindex>*	getIndex();
+	mzpIndex*				getIndex();				//entries are cindexRef: idRef is a const char*, not a string
 	f_off						getIndexOffset();
 	instrumentInfo	getInstrument();
 	int							getPeaksCount();
@@ -541,6 +1025,8 @@ public:
 	bool						readChromat(int num=-1);
 	bool						readHeader(int num=-1);
 	bool						readSpectrum(int num=-1);
+	void						setCentroiding(bool b);		//reduce profile scans to centroids as they are decoded (default off)
+	void						setTopPeaks(int n, double window=0);	//keep the n most intense peaks, per m/z window if window>0
 	
 protected:
 
@@ -549,13 +1035,11 @@ private:
 	//  mzpSAXMzxmlHandler private functions
 	void	pushSpectrum();	// Load current data into pvSpec, may have to guess charge
 	f_off readIndexOffset();
+	int		scanSpan(int pos, bool header=false) const;
 	void	stopParser();
 
 	//  mzpSAXMzxmlHandler Base64 conversion functions
-	void decode32();
-	void decode64();
-	void decompress32();
-	void decompress64();
+	void decodePeaks();
 	unsigned long dtohl(uint32_t l, bool bNet);
 	uint64_t dtohl(uint64_t l, bool bNet);
 
@@ -569,6 +1053,7 @@ private:
 	bool m_bInScan;
 
 	//  mzpSAXMzxmlHandler procedural flags.
+	bool m_bCentroid;		// centroid profile scans, set by setCentroiding()
 	bool m_bCompressedData;
 	bool m_bHeaderOnly;
 	bool m_bLowPrecision;
@@ -577,7 +1062,7 @@ private:
 	bool m_bScanIndex;
 	
 	//  mzpSAXMzxmlHandler index data members.
-	vector<cindex>		m_vIndex;
+	mzpIndex					m_vIndex;
 	cindex						curIndex;
 	int								posIndex;
 	f_off							indexOffset;
@@ -589,8 +1074,12 @@ private:
 	string									m_strData;			// For collecting character data.
 	vector<instrumentInfo>	m_vInstrument;
 	BasicSpectrum*					spec;
+	mzpCentroider						m_centroider;
+	mzpTopPeaks							m_topPeaks;			// Decode-time peak selection, set by setTopPeaks()
 	vector<double>					vdI;
 	vector<double>					vdM;						// Peak list vectors (masses and charges)
+	vector<char>						m_vDecoded;			// decodePeaks() buffers, reused between scans
+	vector<char>						m_vUnzipped;
 
 };
 
@@ -1339,7 +1828,7 @@ public:
 	bool							get();
 	unsigned int			size();
 
-	vector<cindex>*			vChromatIndex;
+	mzpIndex*						vChromatIndex;
   #ifdef MZP_MZ5
 	vector<cMz5Index>*	vMz5Index;
   #endif
@@ -1399,12 +1888,17 @@ public:
 	~MzParser();
 
 	//User functions
+	bool	decodeAll(mzpSpectrumCallback fn, void* data, int threads=0);	//every spectrum, in order
+	bool	streamAll(mzpSpectrumCallback fn, void* data);	//every spectrum, in file order, one thread
+	bool	extractXIC(const vector<double>& mz, double ppm, vector<BasicChromatogram>& xics, int threads=0);	//from all MS1 spectra
 	int		highChromat();
 	int		highScan();
 	bool	load(char* fname);
 	int		lowScan();
 	bool	readChromatogram(int num=-1);
+	bool	readSpectra(const vector<int>& scans, vector<BasicSpectrum>& specs);
 	bool	readSpectrum(int num=-1);
+	bool	readSpectrum(const mzpSpectrumFilter& f);
 	bool  readSpectrumHeader(int num=-1);
 
 protected:
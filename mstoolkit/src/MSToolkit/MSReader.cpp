@@ -1496,6 +1496,10 @@ bool MSReader::readMZPFile(const char* c, Spectrum& s, int scNum){
 		  	s.add((double)pPeaks[j],(float)pPeaks[j+1]);
 			  j+=2;
 		  }
+		  //statistics gathered while the peaks were decoded
+		  s.setTIC(rampFileIn->bs->getTotalIonCurrent());
+		  s.setBPI((float)rampFileIn->bs->getBasePeakIntensity());
+		  s.setBPM(rampFileIn->bs->getBasePeakMZ());
 		}	else {
 		  return false;
 		}
@@ -1557,6 +1561,9 @@ bool MSReader::readMZPFile(const char* c, Spectrum& s, int scNum){
 			s.add((double)pPeaks[j],(float)pPeaks[j+1]);
 			j+=2;
 		}
+		s.setTIC(rampFileIn->bs->getTotalIonCurrent());
+		s.setBPI((float)rampFileIn->bs->getBasePeakIntensity());
+		s.setBPM(rampFileIn->bs->getBasePeakMZ());
 	}
 
 	free(pPeaks);
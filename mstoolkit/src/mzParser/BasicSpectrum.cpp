@@ -22,6 +22,7 @@ BasicSpectrum::BasicSpectrum() {
 	msLevel=1;
 	peaksCount=0;
 	positiveScan=true;
+	precision=precDouble;
 	precursorCharge=0;
 	precursorIntensity=0.0;
 	compensationVoltage=0.0;
@@ -31,6 +32,7 @@ BasicSpectrum::BasicSpectrum() {
 	rTime=0.0f;
 	scanIndex=0;
 	scanNum=-1;
+	statsPending=false;
 	totalIonCurrent=0.0;
 	idString[0]='\0';
 	vData.clear();
@@ -38,6 +40,10 @@ BasicSpectrum::BasicSpectrum() {
 BasicSpectrum::BasicSpectrum(const BasicSpectrum& s){
 	vData.clear();
 	for(unsigned int i=0;i<s.vData.size();i++) vData.push_back(s.vData[i]);
+	vMZ=s.vMZ;
+	vMZ32=s.vMZ32;
+	vIntensity32=s.vIntensity32;
+	precision=s.precision;
 	activation=s.activation;
 	basePeakIntensity=s.basePeakIntensity;
 	basePeakMZ=s.basePeakMZ;
@@ -56,9 +62,15 @@ BasicSpectrum::BasicSpectrum(const BasicSpectrum& s){
 	rTime=s.rTime;
 	scanIndex=s.scanIndex;
 	scanNum=s.scanNum;
+	statsPending=s.statsPending;
 	totalIonCurrent=s.totalIonCurrent;
 	strcpy(idString,s.idString);
 	strcpy(filterLine,s.filterLine);
+	binIntensity=s.binIntensity;
+	binMZ=s.binMZ;
+	binArray=s.binArray;
+	vArray=s.vArray;
+	vArrayName=s.vArrayName;
 }
 BasicSpectrum::~BasicSpectrum() { }
 
@@ -69,6 +81,10 @@ BasicSpectrum& BasicSpectrum::operator=(const BasicSpectrum& s){
 	if (this != &s) {
 		vData.clear();
 		for(unsigned int i=0;i<s.vData.size();i++) vData.push_back(s.vData[i]);
+		vMZ=s.vMZ;
+		vMZ32=s.vMZ32;
+		vIntensity32=s.vIntensity32;
+		precision=s.precision;
 		activation=s.activation;
 		basePeakIntensity=s.basePeakIntensity;
 		basePeakMZ=s.basePeakMZ;
@@ -87,20 +103,55 @@ BasicSpectrum& BasicSpectrum::operator=(const BasicSpectrum& s){
 		rTime=s.rTime;
 		scanIndex=s.scanIndex;
 		scanNum=s.scanNum;
+		statsPending=s.statsPending;
 		totalIonCurrent=s.totalIonCurrent;
 		strcpy(filterLine,s.filterLine);
 		strcpy(idString,s.idString);
+		binIntensity=s.binIntensity;
+		binMZ=s.binMZ;
+		binArray=s.binArray;
+		vArray=s.vArray;
+		vArrayName=s.vArrayName;
 	}
 	return *this;
 }
-specDP& BasicSpectrum::operator[ ](const unsigned int index) {
-	return vData[index];
+specDP BasicSpectrum::operator[ ](const unsigned int index) {
+	if(!binMZ.empty()) decodeMZ();
+	if(!binIntensity.empty()) decodeIntensity();
+	if(precision==precDouble) return vData[index];
+	specDP dp;
+	dp.mz=getMZ(index);
+	dp.intensity=vIntensity32[index];
+	return dp;
 }
 
 //------------------------------------------
 //  Modifiers
 //------------------------------------------
-void BasicSpectrum::addDP(specDP dp) { vData.push_back(dp);}
+void BasicSpectrum::addArray(const char* name, mzpBinaryArray& a){
+	binArray.push_back(mzpBinaryArray());
+	binArray.back().swap(a);
+	a.clear();
+	vArray.push_back(vector<double>());
+	vArrayName.push_back(name);
+}
+void BasicSpectrum::addDP(specDP dp) {
+	if(!binMZ.empty()) decodeMZ();
+	if(!binIntensity.empty()) decodeIntensity();
+	switch(precision){
+	case precFloat:
+		vMZ32.push_back((float)dp.mz);
+		vIntensity32.push_back((float)dp.intensity);
+		break;
+	case precFloatIntensity:
+		vMZ.push_back(dp.mz);
+		vIntensity32.push_back((float)dp.intensity);
+		break;
+	default:
+		vData.push_back(dp);
+		break;
+	}
+}
 void BasicSpectrum::clear(){
 	activation=none;
 	basePeakIntensity=0.0;
@@ -121,12 +172,28 @@ void BasicSpectrum::clear(){
 	rTime=0.0f;
 	scanIndex=0;
 	scanNum=-1;
+	statsPending=false;
 	totalIonCurrent=0.0;
 	vData.clear();
+	vMZ.clear();
+	vMZ32.clear();
+	vIntensity32.clear();
+	binIntensity.clear();
+	binMZ.clear();
+	binArray.clear();
+	vArray.clear();
+	vArrayName.clear();
 }
 void BasicSpectrum::setActivation(int a){ activation=a;}
 void BasicSpectrum::setBasePeakIntensity(double d){ basePeakIntensity=d;}
 void BasicSpectrum::setBasePeakMZ(double d){ basePeakMZ=d;}
+void BasicSpectrum::setBinaryData(mzpBinaryArray& mz, mzpBinaryArray& intensity){
+	statsPending = !mz.empty() && !intensity.empty();
+	binMZ.swap(mz);
+	binIntensity.swap(intensity);
+	mz.clear();
+	intensity.clear();
+}
 void BasicSpectrum::setCentroid(bool b){ centroid=b;}
 void BasicSpectrum::setCollisionEnergy(double d){ collisionEnergy=d;}
 void BasicSpectrum::setCompensationVoltage(double d){ compensationVoltage=d; }
@@ -141,8 +208,48 @@ void BasicSpectrum::setIDString(char* str) {
 }
 void BasicSpectrum::setLowMZ(double d){ lowMZ=d;}
 void BasicSpectrum::setMSLevel(int level){ msLevel=level;}
+//Statistics gathered while the peaks were decoded. Values reported by the file are kept.
+void BasicSpectrum::setPeakStats(double tic, double bpMZ, double bpIntensity, double lo, double hi){
+	if(totalIonCurrent==0) totalIonCurrent=tic;
+	if(basePeakIntensity==0 && basePeakMZ==0){
+		basePeakIntensity=bpIntensity;
+		basePeakMZ=bpMZ;
+	}
+	if(lowMZ==0) lowMZ=lo;
+	if(highMZ==0) highMZ=hi;
+}
 void BasicSpectrum::setPeaksCount(int i){ peaksCount=i;}
 void BasicSpectrum::setPositiveScan(bool b){ positiveScan=b;}
+void BasicSpectrum::setPrecision(int p){
+	if(p==precision) return;
+
+	//gather the decoded points as doubles, then store them in the new columns
+	vector<specDP> v;
+	if(precision==precDouble) v.swap(vData);
+	else {
+		v.resize(vIntensity32.size());
+		for(size_t i=0;i<v.size();i++){
+			v[i].mz = precision==precFloat ? vMZ32[i] : vMZ[i];
+			v[i].intensity=vIntensity32[i];
+		}
+		vector<double>().swap(vMZ);
+		vector<float>().swap(vMZ32);
+		vector<float>().swap(vIntensity32);
+	}
+	precision=p;
+	if(precision==precDouble) {
+		vData.swap(v);
+		return;
+	}
+	if(precision==precFloat) vMZ32.resize(v.size());
+	else vMZ.resize(v.size());
+	vIntensity32.resize(v.size());
+	for(size_t i=0;i<v.size();i++){
+		if(precision==precFloat) vMZ32[i]=(float)v[i].mz;
+		else vMZ[i]=v[i].mz;
+		vIntensity32[i]=(float)v[i].intensity;
+	}
+}
 void BasicSpectrum::setPrecursorCharge(int z){ precursorCharge=z;}
 void BasicSpectrum::setPrecursorIntensity(double d){ precursorIntensity=d;}
 void BasicSpectrum::setPrecursorMonoMZ(double mz){ precursorMonoMZ=mz;}
@@ -156,9 +263,31 @@ void BasicSpectrum::setTotalIonCurrent(double d){ totalIonCurrent=d;}
 //------------------------------------------
 //  Accessors
 //------------------------------------------
+int BasicSpectrum::findArray(const char* name){
+	for(size_t i=0;i<vArrayName.size();i++){
+		if(vArrayName[i]==name) return (int)i;
+	}
+	return -1;
+}
 int BasicSpectrum::getActivation(){ return activation;}
-double BasicSpectrum::getBasePeakIntensity(){ return basePeakIntensity;}
-double BasicSpectrum::getBasePeakMZ(){ return basePeakMZ;}
+vector<double>& BasicSpectrum::getArray(int a){
+	if(!binArray[a].empty()){
+		binArray[a].decode(vArray[a]);
+		binArray[a].clear();
+	}
+	return vArray[a];
+}
+int BasicSpectrum::getArrayCount(){ return (int)vArrayName.size();}
+const char* BasicSpectrum::getArrayName(int a){ return vArrayName[a].c_str();}
+//Statistics the file did not report are known once the arrays are decoded
+double BasicSpectrum::getBasePeakIntensity(){
+	if(basePeakIntensity==0) decodeStats();
+	return basePeakIntensity;
+}
+double BasicSpectrum::getBasePeakMZ(){
+	if(basePeakMZ==0) decodeStats();
+	return basePeakMZ;
+}
 bool BasicSpectrum::getCentroid(){ return centroid;}
 double BasicSpectrum::getCollisionEnergy(){ return collisionEnergy;}
 double BasicSpectrum::getCompensationVoltage(){ return compensationVoltage;}
@@ -166,15 +295,35 @@ int BasicSpectrum::getFilterLine(char* str) {
 	strcpy(str,filterLine);
 	return strlen(str);
 }
-double BasicSpectrum::getHighMZ(){ return highMZ;}
+double BasicSpectrum::getHighMZ(){
+	if(highMZ==0) decodeStats();
+	return highMZ;
+}
 int BasicSpectrum::getIDString(char* str) { 
 	strcpy(str,idString);
 	return strlen(str);
 }
-double BasicSpectrum::getLowMZ(){ return lowMZ;}
+double BasicSpectrum::getIntensity(const unsigned int index){
+	if(!binIntensity.empty()) decodeIntensity();
+	if(precision==precDouble) return vData[index].intensity;
+	return vIntensity32[index];
+}
+double BasicSpectrum::getLowMZ(){
+	if(lowMZ==0) decodeStats();
+	return lowMZ;
+}
 int BasicSpectrum::getMSLevel(){ return msLevel;}
+double BasicSpectrum::getMZ(const unsigned int index){
+	if(!binMZ.empty()) decodeMZ();
+	switch(precision){
+	case precFloat: return vMZ32[index];
+	case precFloatIntensity: return vMZ[index];
+	default: return vData[index].mz;
+	}
+}
 int BasicSpectrum::getPeaksCount(){ return peaksCount;}
 bool BasicSpectrum::getPositiveScan(){ return positiveScan;}
+int BasicSpectrum::getPrecision(){ return precision;}
 int BasicSpectrum::getPrecursorCharge(){ return precursorCharge;}
 double BasicSpectrum::getPrecursorIntensity(){ return precursorIntensity;}
 double BasicSpectrum::getPrecursorMonoMZ(){ return precursorMonoMZ;}
@@ -186,6 +335,346 @@ float BasicSpectrum::getRTime(bool min){
 }
 int BasicSpectrum::getScanIndex(){ return scanIndex;}
 int BasicSpectrum::getScanNum(){ return scanNum;}
-double BasicSpectrum::getTotalIonCurrent(){ return totalIonCurrent;}
-unsigned int BasicSpectrum::size(){ return vData.size();}
+double BasicSpectrum::getTotalIonCurrent(){
+	if(totalIonCurrent==0) decodeStats();
+	return totalIonCurrent;
+}
+unsigned int BasicSpectrum::size(){
+	if(!binMZ.empty()) decodeMZ();
+	if(!binIntensity.empty()) decodeIntensity();
+	if(precision==precDouble) return vData.size();
+	return vIntensity32.size();
+}
 
+//------------------------------------------
+//  Private functions
+//------------------------------------------
+//In the float modes the arrays are decoded straight into their columns
+void BasicSpectrum::decodeIntensity(){
+	if(precision!=precDouble){
+		binIntensity.decode(vIntensity32);
+		binIntensity.clear();
+		matchColumns();
+	} else {
+		vector<double> d;
+		binIntensity.decode(d);
+		binIntensity.clear();
+		if(vData.size()<d.size()) vData.resize(d.size());
+		for(size_t i=0;i<d.size();i++) vData[i].intensity=d[i];
+	}
+	if(statsPending && binMZ.empty()) gatherStats();
+}
+void BasicSpectrum::decodeMZ(){
+	if(precision!=precDouble){
+		if(precision==precFloat) binMZ.decode(vMZ32);
+		else binMZ.decode(vMZ);
+		binMZ.clear();
+		matchColumns();
+	} else {
+		vector<double> d;
+		binMZ.decode(d);
+		binMZ.clear();
+		if(vData.size()<d.size()) vData.resize(d.size());
+		for(size_t i=0;i<d.size();i++) vData[i].mz=d[i];
+	}
+	if(statsPending && binIntensity.empty()) gatherStats();
+}
+//Decodes whatever is left of the arrays if their statistics are still wanted
+void BasicSpectrum::decodeStats(){
+	if(!statsPending) return;
+	if(!binMZ.empty()) decodeMZ();
+	if(!binIntensity.empty()) decodeIntensity();
+}
+//Peak statistics over the decoded columns, for spectra that were decoded lazily
+void BasicSpectrum::gatherStats(){
+	statsPending=false;
+	size_t n = precision==precDouble ? vData.size() : vIntensity32.size();
+	mzpPeakStats stats;
+	double mz,intensity;
+	for(size_t i=0;i<n;i++){
+		switch(precision){
+		case precFloat:
+			mz=vMZ32[i];
+			intensity=vIntensity32[i];
+			break;
+		case precFloatIntensity:
+			mz=vMZ[i];
+			intensity=vIntensity32[i];
+			break;
+		default:
+			mz=vData[i].mz;
+			intensity=vData[i].intensity;
+			break;
+		}
+		stats.add(mz,intensity);
+	}
+	stats.store(*this);
+}
+//Pads the shorter of the float mode columns so both have the same length
+void BasicSpectrum::matchColumns(){
+	size_t n = precision==precFloat ? vMZ32.size() : vMZ.size();
+	if(n<vIntensity32.size()) n=vIntensity32.size();
+	if(precision==precFloat) vMZ32.resize(n);
+	else vMZ.resize(n);
+	vIntensity32.resize(n);
+}
+
+
+//------------------------------------------
+//  mzpBinaryArray
+//------------------------------------------
+mzpBinaryArray::mzpBinaryArray(){ clear();}
+void mzpBinaryArray::clear(){
+	data.clear();
+	dataType=0;
+	encodedLength=0;
+	numpressLinear=false;
+	numpressPic=false;
+	numpressSlof=false;
+	peaksCount=0;
+	zlib=false;
+}
+void mzpBinaryArray::swap(mzpBinaryArray& a){
+	data.swap(a.data);
+	std::swap(dataType,a.dataType);
+	std::swap(encodedLength,a.encodedLength);
+	std::swap(numpressLinear,a.numpressLinear);
+	std::swap(numpressPic,a.numpressPic);
+	std::swap(numpressSlof,a.numpressSlof);
+	std::swap(peaksCount,a.peaksCount);
+	std::swap(zlib,a.zlib);
+}
+bool mzpBinaryArray::empty() const { return peaksCount<1;}
+
+void mzpBinaryArray::decode(vector<double>& d) const {
+
+  //If there is no data, back out now
+  d.clear();
+	if(peaksCount < 1) return;
+
+  //For byte order correction
+	union udata32 {
+		float d;
+		uint32_t i;  
+	} uData32; 
+
+  union udata64 {
+	  double d;
+		uint64_t i;  
+	} uData64; 
+
+  size_t len;
+  size_t i;
+  char* raw=unpack(len);
+
+  //Numpress decompression
+  if(numpressLinear || numpressSlof || numpressPic){
+    d.resize(peaksCount);
+	try{
+      if(numpressLinear) ms::numpress::MSNumpress::decodeLinear((unsigned char*)raw,len,&d[0]);
+      else if(numpressSlof) ms::numpress::MSNumpress::decodeSlof((unsigned char*)raw,len,&d[0]);
+      else ms::numpress::MSNumpress::decodePic((unsigned char*)raw,len,&d[0]);
+	} catch (const char* ch){
+	  cout << "Exception: " << ch << endl;
+	  exit(EXIT_FAILURE);
+	}
+    delete [] raw;
+    return;
+  }
+
+  //Byte order correction
+  if(dataType==1){
+    uint32_t* raw32 = (uint32_t*)raw;
+    d.resize(len/sizeof(uint32_t)<(size_t)peaksCount ? len/sizeof(uint32_t) : peaksCount);
+    for(i=0;i<d.size();i++){
+      uData32.i = dtohl(raw32[i]);
+      d[i]=uData32.d;
+    }
+  } else if(dataType==2) {
+    uint64_t* raw64 = (uint64_t*)raw;
+    d.resize(len/sizeof(uint64_t)<(size_t)peaksCount ? len/sizeof(uint64_t) : peaksCount);
+    for(i=0;i<d.size();i++){
+      uData64.i = dtohl(raw64[i]);
+      d[i]=uData64.d;
+    }
+  } else if(dataType==3) {
+    uint32_t* raw32 = (uint32_t*)raw;
+    d.resize(len/sizeof(uint32_t)<(size_t)peaksCount ? len/sizeof(uint32_t) : peaksCount);
+    for(i=0;i<d.size();i++) d[i]=(double)(int32_t)dtohl(raw32[i]);
+  } else if(dataType==4) {
+    uint64_t* raw64 = (uint64_t*)raw;
+    d.resize(len/sizeof(uint64_t)<(size_t)peaksCount ? len/sizeof(uint64_t) : peaksCount);
+    for(i=0;i<d.size();i++) d[i]=(double)(int64_t)dtohl(raw64[i]);
+  }
+  delete [] raw;
+
+}
+
+void mzpBinaryArray::decode(vector<float>& f) const {
+
+  f.clear();
+	if(peaksCount < 1) return;
+
+  //anything other than plain 32-bit data is decoded at full precision first
+  if(dataType!=1 || numpressLinear || numpressSlof || numpressPic){
+    vector<double> d;
+    decode(d);
+    f.assign(d.begin(),d.end());
+    return;
+  }
+
+	union udata32 {
+		float d;
+		uint32_t i;  
+	} uData32; 
+
+  size_t len;
+  char* raw=unpack(len);
+  uint32_t* raw32 = (uint32_t*)raw;
+  f.resize(len/sizeof(uint32_t)<(size_t)peaksCount ? len/sizeof(uint32_t) : peaksCount);
+  for(size_t i=0;i<f.size();i++){
+    uData32.i = dtohl(raw32[i]);
+    f[i]=uData32.d;
+  }
+  delete [] raw;
+
+}
+
+//Base64 decodes and, if needed, inflates the array. Returns the bytes, to be
+//freed with delete [], and their count in len.
+char* mzpBinaryArray::unpack(size_t& len) const {
+
+  char* decoded = new char[data.size()+1];  //array for decoded base64 string
+  int decodeLen = b64_decode_mio(decoded,(char*)data.data(),data.size());
+  if(!zlib) {
+    len=decodeLen;
+    return decoded;
+  }
+
+  uLong unzippedLen;
+  if(dataType==1) {
+    unzippedLen = peaksCount*sizeof(uint32_t);
+  } else if(dataType==2) {
+    unzippedLen = peaksCount*sizeof(uint64_t);
+  } else {
+    if(!numpressLinear && !numpressSlof && !numpressPic){
+      cout << "Unknown data format to unzip. Stopping file read." << endl;
+      exit(EXIT_FAILURE);
+    }
+	  //numpressed data is no larger than unpressed 64-bit data, plus the 16 bytes of
+	  //fixed point and first values that lead a short linear array
+	  unzippedLen = peaksCount*sizeof(uint64_t)+16;
+  }
+
+  char* unzipped = new char[unzippedLen];
+  uncompress((Bytef*)unzipped, &unzippedLen, (const Bytef*)decoded, (uLong)decodeLen);
+  delete [] decoded;
+  len=unzippedLen;
+  return unzipped;
+
+}
+
+//mzML binary data is always little-endian
+uint32_t mzpBinaryArray::dtohl(uint32_t l) {
+#ifdef OSX
+	l = (l << 24) | ((l << 8) & 0xFF0000) |
+		(l >> 24) | ((l >> 8) & 0x00FF00);
+#endif
+	return l;
+}
+
+uint64_t mzpBinaryArray::dtohl(uint64_t l) {
+#ifdef OSX
+	l = (l << 56) | ((l << 40) & 0xFF000000000000LL) | ((l << 24) & 0x0000FF0000000000LL) | ((l << 8) & 0x000000FF00000000LL) |
+		(l >> 56) | ((l >> 40) & 0x0000000000FF00LL) | ((l >> 24) & 0x0000000000FF0000LL) | ((l >> 8) & 0x00000000FF000000LL) ;
+#endif
+	return l;
+}
+
+
+//------------------------------------------
+//  mzpHeaderTable
+//------------------------------------------
+void mzpHeaderTable::clear(){ resize(0);}
+void mzpHeaderTable::getRow(int row, BasicSpectrum& s){
+	char str[128];
+	s.clear();
+	s.setActivation(activation[row]);
+	s.setBasePeakIntensity(basePeakIntensity[row]);
+	s.setBasePeakMZ(basePeakMZ[row]);
+	s.setCentroid(centroid[row]);
+	s.setCollisionEnergy(collisionEnergy[row]);
+	s.setCompensationVoltage(compensationVoltage[row]);
+	strncpy(str,filterLine[row].c_str(),127);
+	str[127]='\0';
+	s.setFilterLine(str);
+	s.setHighMZ(highMZ[row]);
+	strncpy(str,idString[row].c_str(),127);
+	str[127]='\0';
+	s.setIDString(str);
+	s.setLowMZ(lowMZ[row]);
+	s.setMSLevel(msLevel[row]);
+	s.setPeaksCount(peaksCount[row]);
+	s.setPositiveScan(positiveScan[row]);
+	s.setPrecursorCharge(precursorCharge[row]);
+	s.setPrecursorIntensity(precursorIntensity[row]);
+	s.setPrecursorMonoMZ(precursorMonoMZ[row]);
+	s.setPrecursorMZ(precursorMZ[row]);
+	s.setPrecursorScanNum(precursorScanNum[row]);
+	s.setRTime(rTime[row]);
+	s.setScanIndex(row+1);
+	s.setScanNum(scanNum[row]);
+	s.setTotalIonCurrent(totalIonCurrent[row]);
+}
+void mzpHeaderTable::resize(int n){
+	activation.resize(n);
+	basePeakIntensity.resize(n);
+	basePeakMZ.resize(n);
+	centroid.resize(n);
+	collisionEnergy.resize(n);
+	compensationVoltage.resize(n);
+	filterLine.resize(n);
+	highMZ.resize(n);
+	idString.resize(n);
+	lowMZ.resize(n);
+	msLevel.resize(n);
+	offset.resize(n);
+	peaksCount.resize(n);
+	positiveScan.resize(n);
+	precursorCharge.resize(n);
+	precursorIntensity.resize(n);
+	precursorMonoMZ.resize(n);
+	precursorMZ.resize(n);
+	precursorScanNum.resize(n);
+	rTime.resize(n);
+	scanNum.resize(n);
+	totalIonCurrent.resize(n);
+}
+void mzpHeaderTable::setRow(int row, BasicSpectrum& s, f_off off){
+	char str[128];
+	activation[row]=s.getActivation();
+	basePeakIntensity[row]=s.getBasePeakIntensity();
+	basePeakMZ[row]=s.getBasePeakMZ();
+	centroid[row]=s.getCentroid();
+	collisionEnergy[row]=s.getCollisionEnergy();
+	compensationVoltage[row]=s.getCompensationVoltage();
+	s.getFilterLine(str);
+	filterLine[row]=str;
+	highMZ[row]=s.getHighMZ();
+	s.getIDString(str);
+	idString[row]=str;
+	lowMZ[row]=s.getLowMZ();
+	msLevel[row]=s.getMSLevel();
+	offset[row]=off;
+	peaksCount[row]=s.getPeaksCount();
+	positiveScan[row]=s.getPositiveScan();
+	precursorCharge[row]=s.getPrecursorCharge();
+	precursorIntensity[row]=s.getPrecursorIntensity();
+	precursorMonoMZ[row]=s.getPrecursorMonoMZ();
+	precursorMZ[row]=s.getPrecursorMZ();
+	precursorScanNum[row]=s.getPrecursorScanNum();
+	rTime[row]=s.getRTime();
+	scanNum[row]=s.getScanNum();
+	totalIonCurrent[row]=s.getTotalIonCurrent();
+}
+int mzpHeaderTable::size(){ return (int)scanNum.size();}
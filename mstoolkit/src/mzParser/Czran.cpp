@@ -52,6 +52,7 @@
 
 Czran::Czran(){
 	index=NULL;
+	bSharedIndex=false;
 	buffer=NULL;
 	lastBuffer=NULL;
 	bufferOffset=0;
@@ -71,10 +72,30 @@ Czran::~Czran(){
 /* Deallocate an index built by build_index() */
 void Czran::free_index(){
     if (index != NULL) {
-        free(index->list);
-        free(index);
+        if (!bSharedIndex) {
+            free(index->list);
+            free(index);
+        }
 				index=NULL;
     }
+    bSharedIndex=false;
+}
+
+/* Use the access points built by another Czran, which must outlive this one.
+   Each Czran keeps its own buffers, so each can read from its own FILE* in
+   its own thread. */
+void Czran::share_index(const Czran& c){
+	free_index();
+	if(buffer!=NULL) free(buffer);
+	if(lastBuffer!=NULL) free(lastBuffer);
+	buffer=NULL;
+	lastBuffer=NULL;
+	bufferOffset=0;
+	bufferLen=0;
+	lastBufferOffset=0;
+	index=c.index;
+	fileSize=c.fileSize;
+	bSharedIndex=true;
 }
 
 /* Add an entry to the access point list.  If out of memory, deallocate the
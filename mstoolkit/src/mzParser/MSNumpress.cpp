@@ -132,60 +132,86 @@ void encodeInt(
 
 
 /**
-* Decodes an int from the half bytes in bp. Lossless reverse of encodeInt
+* Leading ones given by the head half byte of an encoded int, and the number
+* of half bytes that follow the head, both indexed by the head.
 */
-void decodeInt(
+static const unsigned int HEAD_MASK[16] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0xf0000000, 0xff000000, 0xfff00000, 0xffff0000,
+        0xfffff000, 0xffffff00, 0xfffffff0
+};
+static const size_t HEAD_LENGTH[16] = {
+        8, 7, 6, 5, 4, 3, 2, 1, 0,
+        7, 6, 5, 4, 3, 2, 1
+};
+
+/**
+* Returns up to 16 half bytes of data from half byte position hi on, the first
+* in the lowest bits. Half bytes are stored high first within a byte, so the
+* halves of each byte are swapped once the word is read.
+*/
+static inline unsigned long long loadHalfBytes(
                 const unsigned char *data,
-                size_t *di,
-                size_t max_di,
-                size_t *half,
-                int *res
+                size_t dataSize,
+                size_t hi
 ) {
-    size_t n;
-    size_t i;
-    unsigned int mask, m;
-    unsigned char head;
-    unsigned char hb;
-
-        if (*half == 0) {
-                head = data[*di] >> 4;
+        size_t k;
+        size_t di = hi >> 1;
+        unsigned long long w = 0;
+        
+        if (dataSize - di >= 8) {
+                for (k=0; k<8; k++) {
+                        w |= (unsigned long long)data[di+k] << (8*k);
+                }
         } else {
-                head = data[*di] & 0xf;
-                (*di)++;
+                for (k=0; di+k<dataSize; k++) {
+                        w |= (unsigned long long)data[di+k] << (8*k);
+                }
         }
+        w = ((w & 0x0f0f0f0f0f0f0f0fULL) << 4) | ((w >> 4) & 0x0f0f0f0f0f0f0f0fULL);
+        return w >> (4*(hi & 1));
+}
 
-        *half = 1-(*half);
-        *res = 0;
+#define DECODE_BATCH 16        // most ints one word of half bytes can hold
+
+/**
+* Decodes every int that lies wholly within the word of half bytes at half byte
+* position *hi into ints, and moves *hi past them. Lossless reverse of
+* encodeInt. Stops at the end of the data, or at the padding half byte of an
+* odd-length array. Returns the number of ints decoded, 0 only at the end.
+*/
+static inline size_t decodeInts(
+                const unsigned char *data,
+                size_t dataSize,
+                size_t *hi,
+                int *ints
+) {
+        size_t n = 0;
+        size_t h = *hi;
+        size_t hiEnd = 2 * dataSize;
+        size_t avail = 16 - (h & 1);
+        size_t used = 0;
+        unsigned long long w = loadHalfBytes(data, dataSize, h);
         
-        if (head <= 8) {
-                n = head;
-        } else { // leading ones, fill n half bytes in res
-                n = head - 8;
-                mask = 0xf0000000;
-                for (i=0; i<n; i++) {
-                        m = mask >> (4*i);
-                        *res = *res | m;
+        while (h < hiEnd) {
+                if (h == hiEnd - 1 && (data[dataSize - 1] & 0xf) == 0x0) {
+                        break;
                 }
-        }
-        
-        if (n == 8) {
-                return;
-        }
-        
-        if (*di + ((8 - n) - (1 - *half)) / 2 >= max_di) {
-                throw "[MSNumpress::decodeInt] Corrupt input data! ";
-        }
-        
-        for (i=n; i<8; i++) {
-                if (*half == 0) {
-                        hb = data[*di] >> 4;
-                } else {
-                        hb = data[*di] & 0xf;
-                        (*di)++;
+                unsigned int head = (unsigned int)(w & 0xf);
+                size_t length = HEAD_LENGTH[head];
+                if (used + 1 + length > avail) {
+                        break;
                 }
-                *res = *res | (hb << ((i-n)*4));
-                *half = 1 - (*half);
+                if (h + 1 + length > hiEnd) {
+                        throw "[MSNumpress::decodeInt] Corrupt input data! ";
+                }
+                ints[n++] = (int)(HEAD_MASK[head] | ((w >> 4) & (0xffffffffULL >> (32 - 4*length))));
+                w >>= 4 * (1 + length);
+                used += 1 + length;
+                h += 1 + length;
         }
+        *hi = h;
+        return n;
 }
 
 
@@ -308,13 +334,14 @@ size_t decodeLinear(
         size_t i;
         size_t ri = 0;
         unsigned int init;
-        int diff;
         long long ints[3];
         //double d;
-        size_t di;
-        size_t half;
-        long long extrapol;
+        size_t hi;
+        size_t k;
+        size_t n;
+        int diffs[DECODE_BATCH];
         long long y;
+        long long step;
         double fixedPoint;
         
         //printf("Decoding %d bytes with fixed point %f\n", (int)dataSize, fixedPoint);
@@ -345,29 +372,22 @@ size_t decodeLinear(
                 }
                 result[1] = ints[2] / fixedPoint;
                         
-                half = 0;
                 ri = 2;
-                di = 16;
-                
-                //printf(" di ri half int[0] int[1] extrapol diff\n");
+                hi = 32;
                 
-                while (di < dataSize) {
-                        if (di == (dataSize - 1) && half == 1) {
-                                if ((data[di] & 0xf) == 0x0) {
-                                        break;
-                                }
+                // each value is the linear prediction from the previous two plus the decoded
+                // difference, y[i] = 2*y[i-1] - y[i-2] + d[i]. The step y[i] - y[i-1] is then the
+                // running sum of the differences and y the running sum of the steps, so a whole
+                // batch is rebuilt with two prefix sums.
+                y = ints[2];
+                step = ints[2] - ints[1];
+                while ((n = decodeInts(data, dataSize, &hi, diffs)) > 0) {
+                        for (k=0; k<n; k++) {
+                                step += diffs[k];
+                                y += step;
+                                result[ri+k] = y / fixedPoint;
                         }
-                        //printf("%7d %7d %7d %lu %lu %ld", di, ri, half, ints[0], ints[1], extrapol);
-                        
-                        ints[0] = ints[1];
-                        ints[1] = ints[2];
-                        decodeInt(data, &di, dataSize, &half, &diff);
-                        
-                        extrapol = ints[1] + (ints[1] - ints[0]);
-                        y = extrapol + diff;
-                        //printf(" %d \n", diff);
-                        result[ri++]         = y / fixedPoint;
-                        ints[2]                 = y;
+                        ri += n;
                 }
         /*} catch (...) {
                 cerr << "DECODE ERROR" << endl;
@@ -573,31 +593,21 @@ size_t decodePic(
                 double *result
 ) {
         size_t i, ri;
-        int count;
         //double d;
-        size_t di;
-        size_t half;
+        size_t hi;
+        size_t k;
+        size_t n;
+        int ints[DECODE_BATCH];
 
-        //printf("ri di half dSize count\n");
-        
         //try {
-                half = 0;
                 ri = 0;
-                di = 0;
+                hi = 0;
                 
-                while (di < dataSize) {
-                        if (di == (dataSize - 1) && half == 1) {
-                                if ((data[di] & 0xf) == 0x0) {
-                                        break;
-                                }
+                while ((n = decodeInts(data, dataSize, &hi, ints)) > 0) {
+                        for (k=0; k<n; k++) {
+                                result[ri+k] = ints[k];
                         }
-                        
-                        decodeInt(&data[0], &di, dataSize, &half, &count);
-                        
-                        //printf("%7d %7d %7d %7d %7d\n", ri, di, half, dataSize, count);
-                        
-                        //printf("count: %d \n", count);
-                        result[ri++]         = count;
+                        ri += n;
                 }
         /*} catch (...) {
                 cerr << "DECODE ERROR" << endl;
@@ -699,7 +709,7 @@ size_t decodeSlof(
         
         fixedPoint = decodeFixedPoint(data);
 
-        for (i=8; i<dataSize; i+=2) {
+        for (i=8; i+1<dataSize; i+=2) {
                 x = data[i] | (data[i+1] << 8);
                 result[ri++] = exp(x / fixedPoint) - 1;
         }
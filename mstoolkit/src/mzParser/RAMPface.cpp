@@ -280,7 +280,7 @@ char* rampValidFileType(const char *buf){
 //But due to legacy issues, this function must exist.
 void readHeader(RAMPFILE *pFI, ramp_fileoffset_t lScanIndex, struct ScanHeaderStruct *scanHeader){
 
-	vector<cindex>* v;
+	mzpIndex* v;
 #ifdef MZP_MZ5
 	vector<cMz5Index>* v2;
 #endif
@@ -409,7 +409,7 @@ void readHeader(RAMPFILE *pFI, ramp_fileoffset_t lScanIndex, struct ScanHeaderSt
 //MH: Indexes in RAMP are stored in an array indexed by scan number, with -1 for the offset
 //if the scan number does not exist.
 ramp_fileoffset_t* readIndex(RAMPFILE *pFI, ramp_fileoffset_t indexOffset, int *iLastScan){
-	vector<cindex>* v;
+	mzpIndex* v;
 #ifdef MZP_MZ5
 	vector<cMz5Index>* v2;
 #endif
@@ -457,7 +457,7 @@ ramp_fileoffset_t* readIndex(RAMPFILE *pFI, ramp_fileoffset_t indexOffset, int *
 }
 
 int readMsLevel(RAMPFILE *pFI, ramp_fileoffset_t lScanIndex){
-	vector<cindex>* v;
+	mzpIndex* v;
 #ifdef MZP_MZ5
 	vector<cMz5Index>* v2;
 #endif
@@ -511,7 +511,7 @@ int readMsLevel(RAMPFILE *pFI, ramp_fileoffset_t lScanIndex){
 
 void readMSRun(RAMPFILE *pFI, struct RunHeaderStruct *runHeader){
 
-	vector<cindex>* v;
+	mzpIndex* v;
 #ifdef MZP_MZ5
 	vector<cMz5Index>* v2;
 #endif
@@ -569,7 +569,7 @@ void readMSRun(RAMPFILE *pFI, struct RunHeaderStruct *runHeader){
 //MH: Matching the index is very indirect, but requires less code,
 //making this wrapper much easier to read
 RAMPREAL* readPeaks(RAMPFILE* pFI, ramp_fileoffset_t lScanIndex){
-	vector<cindex>* v;
+	mzpIndex* v;
 #ifdef MZP_MZ5
 	vector<cMz5Index>* v2;
 #endif
@@ -623,8 +623,8 @@ RAMPREAL* readPeaks(RAMPFILE* pFI, ramp_fileoffset_t lScanIndex){
 	if(pFI->bs->size()>0){
 		pPeaks = (RAMPREAL *) malloc((pFI->bs->size()+1) * 2 * sizeof(RAMPREAL) + 1);
 		for(i=0;i<pFI->bs->size();i++){
-			pPeaks[j++]=pFI->bs->operator [](i).mz;
-			pPeaks[j++]=pFI->bs->operator [](i).intensity;
+			pPeaks[j++]=pFI->bs->getMZ(i);
+			pPeaks[j++]=pFI->bs->getIntensity(i);
 		}
 	} else {
 		pPeaks = (RAMPREAL *) malloc(2 * sizeof(RAMPREAL));
@@ -641,7 +641,7 @@ int readPeaksCount(RAMPFILE *pFI, ramp_fileoffset_t lScanIndex){
 }
 
 void readRunHeader(RAMPFILE *pFI, ramp_fileoffset_t *pScanIndex, struct RunHeaderStruct *runHeader, int iLastScan){
-	vector<cindex>* v;
+	mzpIndex* v;
 #ifdef MZP_MZ5
 	vector<cMz5Index>* v2;
 #endif
@@ -661,6 +661,8 @@ void readRunHeader(RAMPFILE *pFI, ramp_fileoffset_t *pScanIndex, struct RunHeade
 			v=pFI->mzML->getSpecIndex();
 			runHeader->scanCount=v->size();
 			
+			//every header is visited, so read them all in one pass
+			if(pFI->mzML->getHeaderTable()->size()==0) pFI->mzML->scanHeaders();
 			pFI->mzML->readHeader(v->at(0).scanNum);
 			runHeader->dStartTime=(double)pFI->bs->getRTime(false);
 			runHeader->lowMZ=pFI->bs->getLowMZ();
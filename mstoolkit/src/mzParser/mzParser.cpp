@@ -160,6 +160,106 @@ bool MzParser::readChromatogram(int num){
 	return false;
 }
 
+//Passes every spectrum, in order, to fn. mzML files decode them on a pool of
+//threads; other formats read them one at a time into this parser's spectrum.
+//Returns false if no file is open.
+bool MzParser::decodeAll(mzpSpectrumCallback fn, void* data, int threads){
+	int i;
+	switch(fileType){
+		case 1:
+		case 3:
+			return mzML->decodeAll(fn,data,threads);
+			break;
+		case 2:
+		case 4:
+#ifdef MZP_MZ5
+		case 5:
+#endif
+			for(i=lowScan();i<=highScan();i++){
+				if(readSpectrum(i) && !fn(*spec,data)) break;
+			}
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+//Passes every spectrum, in file order, to fn from one sequential pass over the file
+//for mzML; other formats read them one at a time. This parser's spectrum is used.
+//Returns false if no file is open.
+bool MzParser::streamAll(mzpSpectrumCallback fn, void* data){
+	int i;
+	switch(fileType){
+		case 1:
+		case 3:
+			return mzML->streamAll(fn,data);
+			break;
+		case 2:
+		case 4:
+#ifdef MZP_MZ5
+		case 5:
+#endif
+			for(i=lowScan();i<=highScan();i++){
+				if(readSpectrum(i) && !fn(*spec,data)) break;
+			}
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+//Builds extracted ion chromatograms from all MS1 spectra, in parallel for mzML files.
+bool MzParser::extractXIC(const vector<double>& mz, double ppm, vector<BasicChromatogram>& xics, int threads){
+	int i;
+	vector<int> scans;
+	vector<float> rTimes;
+	switch(fileType){
+		case 1:
+		case 3:
+			return mzML->extractXIC(mz,ppm,xics,threads);
+			break;
+		default:
+			for(i=lowScan();i<=highScan();i++){
+				if(!readSpectrumHeader(i) || spec->getMSLevel()!=1) continue;
+				scans.push_back(i);
+				rTimes.push_back(spec->getRTime());
+			}
+			break;
+	}
+	mzpXIC xic(mz,ppm,xics,rTimes);
+	for(i=0;i<(int)scans.size();i++){
+		if(readSpectrum(scans[i])) xic.addSpectrum(i,*spec);
+	}
+	return true;
+}
+
+//Reads several spectra by scan number into specs, in the order given. mzML files
+//read them in file order with merged reads; other formats read them one at a time.
+bool MzParser::readSpectra(const vector<int>& scans, vector<BasicSpectrum>& specs){
+	unsigned int i;
+	bool ok=true;
+	switch(fileType){
+		case 1:
+		case 3:
+			return mzML->readSpectra(scans,specs);
+			break;
+		default:
+			specs.resize(scans.size());
+			for(i=0;i<scans.size();i++){
+				if(readSpectrum(scans[i])) {
+					specs[i]=*spec;
+				} else {
+					specs[i].clear();
+					ok=false;
+				}
+			}
+			break;
+	}
+	return ok;
+}
+
 bool MzParser::readSpectrum(int num){
 	switch(fileType){
 		case 1:
@@ -181,6 +281,23 @@ bool MzParser::readSpectrum(int num){
 	return false;
 }
 
+//Reads the next spectrum that passes f. mzML files check f against the header table,
+//so rejected spectra are never read; other formats check each spectrum header.
+bool MzParser::readSpectrum(const mzpSpectrumFilter& f){
+	switch(fileType){
+		case 1:
+		case 3:
+			return mzML->readSpectrum(f);
+			break;
+		default:
+			while(readSpectrumHeader(-1)){
+				if(f.pass(spec->getMSLevel(),spec->getRTime(),spec->getPrecursorMZ(),spec->getActivation())) return readSpectrum(spec->getScanNum());
+			}
+			break;
+	}
+	return false;
+}
+
 bool MzParser::readSpectrumHeader(int num){
 	switch(fileType){
 		case 1:
@@ -242,3 +359,234 @@ int MzParser::checkFileType(char* fname){
 	cerr << "Unknown file type. No file loaded." << endl;
 	return 0;
 }
+
+//------------------------------------------
+//  mzpSpectrumFilter
+//------------------------------------------
+mzpSpectrumFilter::mzpSpectrumFilter(){
+	activation=-1;
+	msLevelHigh=0;
+	msLevelLow=0;
+	precursorMZHigh=0.0;
+	precursorMZLow=0.0;
+	rTimeHigh=0.0f;
+	rTimeLow=0.0f;
+}
+
+bool mzpSpectrumFilter::pass(int level, float rt, double precursor, int act) const {
+	if(msLevelLow>0 && level<msLevelLow) return false;
+	if(msLevelHigh>0 && level>msLevelHigh) return false;
+	if(rTimeLow>0 && rt<rTimeLow) return false;
+	if(rTimeHigh>0 && rt>rTimeHigh) return false;
+	if(precursorMZLow>0 || precursorMZHigh>0){
+		if(level<2 || precursor<=0) return false;
+		if(precursorMZLow>0 && precursor<precursorMZLow) return false;
+		if(precursorMZHigh>0 && precursor>precursorMZHigh) return false;
+	}
+	if(activation>=0 && act!=activation) return false;
+	return true;
+}
+
+//------------------------------------------
+//  mzpCentroider
+//------------------------------------------
+//Points are assumed to be in increasing m/z order. Adjacent points cannot both be
+//maxima, so centroids are written over points that have already been read.
+void mzpCentroider::centroid(vector<double>& mz, vector<double>& intensity){
+	size_t n=intensity.size();
+	size_t i;
+	size_t j=0;
+	profileSize=n;
+	vApex.clear();
+	if(n<3){
+		for(i=0;i<n;i++) vApex.push_back(i);
+		return;
+	}
+
+	//flag each point above its left neighbor and not below its right one
+	vMax.resize(n);
+	const double* y=&intensity[0];
+	unsigned char* m=&vMax[0];
+	m[0]=0;
+	m[n-1]=0;
+	i=1;
+#ifdef MZP_SSE2
+	for(;i+2<n;i+=2){
+		__m128d c=_mm_loadu_pd(y+i);
+		__m128d up=_mm_cmpgt_pd(c,_mm_loadu_pd(y+i-1));
+		__m128d down=_mm_cmpge_pd(c,_mm_loadu_pd(y+i+1));
+		int bits=_mm_movemask_pd(_mm_and_pd(up,down));
+		m[i]=(unsigned char)(bits&1);
+		m[i+1]=(unsigned char)(bits>>1);
+	}
+#endif
+	for(;i<n-1;i++) m[i] = (unsigned char)((y[i]>y[i-1]) & (y[i]>=y[i+1]));
+
+	for(i=1;i<n-1;i++){
+		if(!m[i]) continue;
+		double x0=mz[i-1];
+		double x1=mz[i];
+		double x2=mz[i+1];
+		double y0=intensity[i-1];
+		double y1=intensity[i];
+		double y2=intensity[i+1];
+		double apexMZ=x1;
+		double apexI=y1;
+		if(x0<x1 && x1<x2){
+			double d1=(y1-y0)/(x1-x0);
+			double a=((y2-y1)/(x2-x1)-d1)/(x2-x0);
+			if(a<0){
+				apexMZ=(x0+x1)/2-d1/(2*a);
+				apexI=y0+d1*(apexMZ-x0)+a*(apexMZ-x0)*(apexMZ-x1);
+			}
+		}
+		mz[j]=apexMZ;
+		intensity[j]=apexI;
+		vApex.push_back(i);
+		j++;
+	}
+	mz.resize(j);
+	intensity.resize(j);
+}
+
+void mzpCentroider::compact(vector<double>& v) const {
+	if(v.size()!=profileSize) return;
+	for(size_t i=0;i<vApex.size();i++) v[i]=v[vApex[i]];
+	v.resize(vApex.size());
+}
+
+//------------------------------------------
+//  mzpPeakStats
+//------------------------------------------
+mzpPeakStats::mzpPeakStats(){
+	count=0;
+	tic=0;
+	bpMZ=0;
+	bpIntensity=0;
+	lowMZ=0;
+	highMZ=0;
+}
+
+void mzpPeakStats::store(BasicSpectrum& s) const {
+	if(count>0) s.setPeakStats(tic,bpMZ,bpIntensity,lowMZ,highMZ);
+}
+
+//------------------------------------------
+//  mzpTopPeaks
+//------------------------------------------
+mzpTopPeaks::mzpTopPeaks(){
+	topN=0;
+	window=0.0;
+}
+
+bool mzpTopPeaks::active() const { return topN>0;}
+
+void mzpTopPeaks::compact(vector<double>& v) const {
+	if(v.size()!=keep.size()) return;
+	size_t j=0;
+	for(size_t i=0;i<v.size();i++){
+		if(keep[i]) v[j++]=v[i];
+	}
+	v.resize(j);
+}
+
+//Windows are fixed m/z bins of the given width. A window runs as long as consecutive
+//peaks fall in the same bin, which follows the m/z order that spectra are stored in.
+void mzpTopPeaks::select(const vector<double>& mz, const vector<double>& intensity){
+	size_t n=intensity.size();
+	size_t first=0;
+	size_t last;
+	keep.assign(n,1);
+	if(topN<1) return;
+	while(first<n){
+		last=n;
+		if(window>0){
+			long long bin=(long long)(mz[first]/window);
+			for(last=first+1;last<n && (long long)(mz[last]/window)==bin;last++);
+		}
+		if(last-first>(size_t)topN) selectRange(intensity,first,last);
+		first=last;
+	}
+}
+
+static bool mzpGreater(double a, double b){ return a>b;}
+
+//Peaks tied at the cutoff intensity are kept in order until topN is reached
+void mzpTopPeaks::selectRange(const vector<double>& intensity, size_t first, size_t last){
+	size_t i;
+	work.assign(intensity.begin()+first,intensity.begin()+last);
+	nth_element(work.begin(),work.begin()+(topN-1),work.end(),mzpGreater);
+	double cutoff=work[topN-1];
+	size_t ties=topN;
+	for(i=first;i<last;i++){
+		if(intensity[i]>cutoff) ties--;
+	}
+	for(i=first;i<last;i++){
+		if(intensity[i]>cutoff) continue;
+		if(intensity[i]==cutoff && ties>0) ties--;
+		else keep[i]=0;
+	}
+}
+
+//------------------------------------------
+//  mzpXIC
+//------------------------------------------
+mzpXIC::mzpXIC(const vector<double>& mz, double ppm, vector<BasicChromatogram>& xics, const vector<float>& rTimes){
+	size_t i,j;
+	char str[128];
+
+	xics.resize(mz.size());
+	for(i=0;i<mz.size();i++){
+		xics[i].clear();
+		sprintf(str,"XIC %.4f",mz[i]);
+		xics[i].setIDString(str);
+		vector<TimeIntensityPair>& v=xics[i].getData();
+		v.resize(rTimes.size());
+		for(j=0;j<rTimes.size();j++){
+			v[j].time=rTimes[j];
+			v[j].intensity=0.0;
+		}
+	}
+
+	vector<pair<double,int> > vTarget(mz.size());
+	for(i=0;i<mz.size();i++) vTarget[i]=make_pair(mz[i],(int)i);
+	sort(vTarget.begin(),vTarget.end());
+	vLow.resize(mz.size());
+	vHigh.resize(mz.size());
+	vOut.resize(mz.size());
+	for(i=0;i<mz.size();i++){
+		double tol=vTarget[i].first*ppm/1000000.0;
+		vLow[i]=vTarget[i].first-tol;
+		vHigh[i]=vTarget[i].first+tol;
+		vOut[i]= rTimes.size()>0 ? &xics[vTarget[i].second].getData()[0] : NULL;
+	}
+}
+
+static bool mzpCompareMZ(const specDP& a, const specDP& b){ return a.mz<b.mz;}
+
+//The low and high limits rise with the target m/z, so one pass over peaks in m/z
+//order finds every window; only overlapping windows revisit a peak.
+void mzpXIC::addSpectrum(int row, BasicSpectrum& s){
+	unsigned int n=s.size();
+	unsigned int i,j;
+	size_t t;
+	if(n==0) return;
+
+	vector<specDP> vPeaks(n);
+	bool bSorted=true;
+	for(i=0;i<n;i++){
+		vPeaks[i].mz=s.getMZ(i);
+		vPeaks[i].intensity=s.getIntensity(i);
+		if(i>0 && vPeaks[i].mz<vPeaks[i-1].mz) bSorted=false;
+	}
+	if(!bSorted) sort(vPeaks.begin(),vPeaks.end(),mzpCompareMZ);
+
+	i=0;
+	for(t=0;t<vLow.size();t++){
+		while(i<n && vPeaks[i].mz<vLow[t]) i++;
+		if(i==n) break;
+		double sum=0.0;
+		for(j=i;j<n && vPeaks[j].mz<=vHigh[t];j++) sum+=vPeaks[j].intensity;
+		vOut[t][row].intensity=sum;
+	}
+}
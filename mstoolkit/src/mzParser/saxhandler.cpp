@@ -150,7 +150,9 @@ mzpSAXHandler::mzpSAXHandler()
 {
 	fptr = NULL;
 	m_bGZCompression = false;
-	fptr = NULL;
+	mzgf = NULL;
+	m_fileOffset = 0;
+	m_bIndexCache = true;
 	m_parser = XML_ParserCreate(NULL);
 	XML_SetUserData(m_parser, this);
 	XML_SetElementHandler(m_parser, mzp_startElementCallback, mzp_endElementCallback);
@@ -162,6 +164,11 @@ mzpSAXHandler::~mzpSAXHandler()
 {
 	if(fptr!=NULL) fclose(fptr);
 	fptr = NULL;
+	if(mzgf!=NULL) {
+		mzgf->close();
+		delete mzgf;
+	}
+	mzgf = NULL;
 	XML_ParserFree(m_parser);
 }
 
@@ -179,30 +186,42 @@ void mzpSAXHandler::characters(const XML_Char *s, int len)
 }
 
 bool mzpSAXHandler::open(const char* fileName){
-cerr << "SAXHandler opening\n";
 	if(fptr!=NULL) fclose(fptr);
+	fptr=NULL;
+	if(mzgf!=NULL){
+		mzgf->close();
+		delete mzgf;
+		mzgf=NULL;
+	}
+
+	//gz files are read through MZGF block access when possible, otherwise through Czran
 	if(m_bGZCompression) {
 		mzgf = new MZGFile::MZGFileReader();
 		int rc = mzgf->open( fileName );
 		if ( rc == MZGF_NOT_MZGZIP ) {
-		   delete mzgf;
-		   fptr=fopen(fileName,"rb");
+			mzgf->close();
+			delete mzgf;
+			mzgf=NULL;
+			fptr=fopen(fileName,"rb");
 		} else if ( rc ) {
-		   cerr << "Failed to open input file '" << fileName << "':";
-		   cerr << mzgf->strerror() << "\n";
-		   delete mzgf;
-		   return false;
+			cerr << "Failed to open input file '" << fileName << "':";
+			cerr << mzgf->strerror() << "\n";
+			mzgf->close();
+			delete mzgf;
+			mzgf=NULL;
+			return false;
 		}
 	}
 	else fptr=fopen(fileName,"r");
-	if(fptr==NULL){
+	if(fptr==NULL && mzgf==NULL){
 		cerr << "Failed to open input file '" << fileName << "'.\n";
 		return false;
 	}
 	setFileName(fileName);
+	m_fileOffset=0;
 
 	//Build the index if gz compressed
-	if(m_bGZCompression){
+	if(m_bGZCompression && mzgf==NULL){
 		gzObj.free_index();
 
 		int len;
@@ -232,33 +251,69 @@ cerr << "SAXHandler opening\n";
 
 }
 
+//Opens the file already opened by h, through the same backend, for reading from
+//another thread. A gz index built by h is shared rather than built again, so h
+//must stay open for as long as this handler reads.
+bool mzpSAXHandler::openShared(const mzpSAXHandler& h){
+	if(fptr!=NULL) fclose(fptr);
+	fptr=NULL;
+	if(mzgf!=NULL){
+		mzgf->close();
+		delete mzgf;
+		mzgf=NULL;
+	}
+	m_bGZCompression=h.m_bGZCompression;
+	m_bIndexCache=h.m_bIndexCache;
+
+	if(h.mzgf!=NULL){
+		mzgf = new MZGFile::MZGFileReader();
+		if(mzgf->open(h.m_strFileName.c_str())){
+			cerr << "Failed to open input file '" << h.m_strFileName << "':";
+			cerr << mzgf->strerror() << "\n";
+			mzgf->close();
+			delete mzgf;
+			mzgf=NULL;
+			return false;
+		}
+	} else {
+		fptr=fopen(h.m_strFileName.c_str(),"rb");
+		if(fptr==NULL){
+			cerr << "Failed to open input file '" << h.m_strFileName << "'.\n";
+			return false;
+		}
+		if(m_bGZCompression) gzObj.share_index(h.gzObj);
+	}
+	setFileName(h.m_strFileName.c_str());
+	m_fileOffset=0;
+	return true;
+}
+
+//Reads the whole file. Plain data are read directly into expat's own buffer,
+//avoiding an intermediate copy. Compressed data are decompressed on a second
+//thread while the parser works, see parsePipe().
 bool mzpSAXHandler::parse()
 {
-	if (fptr == NULL){
+	if (fptr == NULL && mzgf == NULL){
 		cerr << "Error parse(): No open file." << endl;
 		return false;
 	}
 
-	char buffer[CHUNK];  //CHUNK=16384
 	int readBytes = 0;
 	bool success = true;
-	int chunk=0;
-
-   if (mzgf) {
-		while (success && (readBytes = (int) mzgf->read( (unsigned char*)buffer, sizeof(buffer) )) != 0){
-			success = (XML_Parse(m_parser, buffer, readBytes, false) != 0);
-		}
-   } else if(m_bGZCompression){
-		while (success && (readBytes = gzObj.extract(fptr, 0+chunk*CHUNK, (unsigned char*)buffer, CHUNK))>0) {
-			success = (XML_Parse(m_parser, buffer, readBytes, false) != 0);
-			chunk++;
-		}
-	} else {
-		while (success && (readBytes = (int) fread(buffer, 1, sizeof(buffer), fptr)) != 0){
-			success = (XML_Parse(m_parser, buffer, readBytes, false) != 0);
+	void* buffer;
+
+	seekFile(0);
+	if(mzgf!=NULL || m_bGZCompression) success = parsePipe();
+	else while (success) {
+		buffer = XML_GetBuffer(m_parser, CHUNK);
+		if (buffer == NULL) {
+			success = false;
+			break;
 		}
+		if ((readBytes = readFile((char*)buffer, CHUNK)) == 0) break;
+		success = (XML_ParseBuffer(m_parser, readBytes, false) != 0);
 	}
-	success = success && (XML_Parse(m_parser, buffer, 0, true) != 0);
+	success = success && (XML_ParseBuffer(m_parser, 0, true) != 0);
 
 	if (!success)
 	{
@@ -288,46 +343,107 @@ bool mzpSAXHandler::parse()
 	return true;
 }
 
+//Waits until a no longer holds v, or the pipe is cancelled. Polls briefly, since
+//the other side is usually about to move, then sleeps until mzpPipeWake().
+static void mzpPipeWait(mzpPipeRing* r, atomic<unsigned int>& a, unsigned int v){
+	for(int i=0;i<MZP_PIPE_SPIN;i++){
+		if(a.load(memory_order_acquire)!=v || r->cancel) return;
+	}
+	unique_lock<mutex> lk(r->lock);
+	r->sleepers++;
+	while(a.load()==v && !r->cancel) r->cv.wait(lk);
+	r->sleepers--;
+}
+
+//Called after moving head, tail or cancel; wakes the other side if it sleeps.
+static void mzpPipeWake(mzpPipeRing* r){
+	if(r->sleepers.load()==0) return;
+	lock_guard<mutex> lk(r->lock);
+	r->cv.notify_all();
+}
+
+//Parses the file as it is decompressed by pipeFill() on another thread, so that
+//a whole-file pass takes as long as the slower of the two rather than their sum.
+//Does not finish the parse; parse() does.
+bool mzpSAXHandler::parsePipe(){
+	int i;
+	bool success = true;
+	mzpPipeRing r;
+	for(i=0;i<MZP_PIPE_SLOTS;i++) r.buf[i] = new char[MZP_PIPE_BUF];
+	r.head = 0;
+	r.tail = 0;
+	r.cancel = false;
+	r.sleepers = 0;
+
+	thread t(&mzpSAXHandler::pipeFill,this,&r);
+	unsigned int tail = 0;
+	while(success){
+		mzpPipeWait(&r,r.head,tail);
+		i = tail%MZP_PIPE_SLOTS;
+		if(r.len[i]==0) break;
+		success = (XML_Parse(m_parser, r.buf[i], r.len[i], false) != 0);
+		r.tail.store(++tail);
+		mzpPipeWake(&r);
+	}
+	r.cancel = true;
+	mzpPipeWake(&r);
+	t.join();
+
+	for(i=0;i<MZP_PIPE_SLOTS;i++) delete [] r.buf[i];
+	return success;
+}
+
+//Producer side of parsePipe(): fills free ring slots from the file until the
+//end of the file, or until the parser stops.
+void mzpSAXHandler::pipeFill(mzpPipeRing* r){
+	unsigned int head = 0;
+	while(!r->cancel){
+		if(head - r->tail.load(memory_order_acquire) == MZP_PIPE_SLOTS) {
+			mzpPipeWait(r,r->tail,head-MZP_PIPE_SLOTS);
+			continue;
+		}
+		int i = head%MZP_PIPE_SLOTS;
+		r->len[i] = readFile(r->buf[i], MZP_PIPE_BUF);
+		r->head.store(++head);
+		mzpPipeWake(r);
+		if(r->len[i]==0) break;
+	}
+}
+
 //This function operates similarly to the parse() function.
 //However, it accepts a file offset to begin parsing at a specific point.
 //The parser will halt file reading when stop flag is triggered.
-bool mzpSAXHandler::parseOffset(f_off offset){
+//If the length of the element at the offset is known (e.g. from the index),
+//passing it as len lets the first read cover the element in one buffer.
+bool mzpSAXHandler::parseOffset(f_off offset, int len){
 
-	if (fptr == NULL){
+	if (fptr == NULL && mzgf == NULL){
 		cerr << "Error parseOffset(): No open file." << endl;
 		return false;
 	}
-	char buffer[CHUNK]; //CHUNK=16384
 	int readBytes = 0;
 	bool success = true;
-	int chunk=0;
+	int bufSize = len>0 ? len : CHUNK;
+	void* buffer;
 	
 	XML_ParserReset(m_parser,"ISO-8859-1");
 	XML_SetUserData(m_parser, this);
 	XML_SetElementHandler(m_parser, mzp_startElementCallback, mzp_endElementCallback);
 	XML_SetCharacterDataHandler(m_parser, mzp_charactersCallback);
 
-   if ( mzgf ) mzgf->useek(offset);
-   else mzpfseek(fptr,offset,SEEK_SET);
+	seekFile(offset);
 	m_bStopParse=false;
 
-
-	if ( mzgf ) {
-		while (success && (readBytes = (int) mzgf->read((unsigned char*)buffer, sizeof(buffer) )) != 0) {
-			success = (XML_Parse(m_parser, buffer, readBytes, false) != 0);
-			if(m_bStopParse) break;
-		}
-	} else if(m_bGZCompression){
-		while (success && (readBytes = gzObj.extract(fptr, offset+chunk*CHUNK, (unsigned char*)buffer, CHUNK))>0) {
-			success = (XML_Parse(m_parser, buffer, readBytes, false) != 0);
-			chunk++;
-			if(m_bStopParse) break;
-		}
-	} else {
-		while (success && (readBytes = (int) fread(buffer, 1, sizeof(buffer), fptr)) != 0) {
-			success = (XML_Parse(m_parser, buffer, readBytes, false) != 0);
-			if(m_bStopParse) break;
+	while (success) {
+		buffer = XML_GetBuffer(m_parser, bufSize);
+		if (buffer == NULL) {
+			success = false;
+			break;
 		}
+		if ((readBytes = readFile((char*)buffer, bufSize)) == 0) break;
+		success = (XML_ParseBuffer(m_parser, readBytes, false) != 0);
+		if(m_bStopParse) break;
+		bufSize = CHUNK;
 	}
 
 	if (!success && !m_bStopParse)
@@ -359,6 +475,260 @@ bool mzpSAXHandler::parseOffset(f_off offset){
 	return true;
 }
 
+//Returns the length of the element at position pos of an index, taken as the
+//distance to the next offset. The last element runs to end, if given (e.g. the
+//index list offset). Returns 0 if the index cannot tell.
+int mzpSAXHandler::indexSpan(const mzpIndex& v, int pos, f_off end){
+	if(pos<0 || pos>=(int)v.size()) return 0;
+	if(pos+1<(int)v.size()) end=v.offset[pos+1];
+	f_off len=end-v.offset[pos];
+	if(len<=0 || len>MAXSPAN) return 0;
+	return (int)len;
+}
+
+//Positions the file at an offset in the uncompressed data, whichever
+//reader (MZGF, Czran, or plain file) is in use.
+void mzpSAXHandler::seekFile(f_off offset){
+	m_fileOffset=offset;
+	if(mzgf) mzgf->useek(offset);
+	else if(!m_bGZCompression) mzpfseek(fptr,offset,SEEK_SET);
+}
+
+//Reads up to len bytes of uncompressed data from the current position.
+//Returns the number of bytes read, 0 at the end of the file.
+int mzpSAXHandler::readFile(char* buf, int len){
+	int readBytes;
+	if(mzgf) readBytes = (int) mzgf->read((unsigned char*)buf, len);
+	else if(m_bGZCompression) {
+		//Czran has no notion of end of file; clamp reads to the uncompressed size
+		f_off remain = gzObj.getfilesize() - m_fileOffset;
+		if(remain<=0) return 0;
+		if(remain<len) len=(int)remain;
+		readBytes = gzObj.extract(fptr, m_fileOffset, (unsigned char*)buf, len);
+	}
+	else readBytes = (int) fread(buf, 1, len, fptr);
+	if(readBytes<0) return 0;
+	m_fileOffset+=readBytes;
+	return readBytes;
+}
+
 void mzpSAXHandler::setGZCompression(bool b){
 	m_bGZCompression=b;
 }
+
+//The index cache is a binary sidecar (file name + MZP_INDEX_CACHE_EXT) that holds the
+//spectrum and chromatogram indexes so that they need not be parsed on every load.
+//Layout: mzpIndexCacheHeader, then offsets of all spectra and chromatograms (int64),
+//their positions in the idRef pool (uint32, one extra for the pool end), spectrum scan
+//numbers (int32), and finally the idRef pool itself. The cache is valid only for a
+//data file of the same size and modification time.
+typedef struct mzpIndexCacheHeader {
+	char			magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;
+	uint64_t	fileSize;
+	int64_t		fileTime;
+	int64_t		indexOffset;
+	uint32_t	specCount;
+	uint32_t	chromatCount;
+	uint64_t	poolSize;
+} mzpIndexCacheHeader;
+
+#define MZP_INDEX_CACHE_MAGIC "MZPIDX"
+#define MZP_INDEX_CACHE_VERSION 1
+
+static bool mzpIndexCacheStat(const string& fileName, mzpIndexCacheHeader& h){
+	struct stat st;
+	if(stat(&fileName[0],&st)!=0) return false;
+	memset(&h,0,sizeof(h));
+	strcpy(h.magic,MZP_INDEX_CACHE_MAGIC);
+	h.version=MZP_INDEX_CACHE_VERSION;
+	h.byteOrder=0x01020304;
+	h.fileSize=(uint64_t)st.st_size;
+	h.fileTime=(int64_t)st.st_mtime;
+	return true;
+}
+
+//Loads the indexes from the cache with a single read. Returns false if there is no
+//cache, or if it does not match the data file.
+bool mzpSAXHandler::readIndexCache(mzpIndex& vSpec, mzpIndex& vChromat, f_off& offset){
+	if(!m_bIndexCache) return false;
+
+	mzpIndexCacheHeader cur,h;
+	if(!mzpIndexCacheStat(m_strFileName,cur)) return false;
+
+	string cacheName=m_strFileName+MZP_INDEX_CACHE_EXT;
+	FILE* f=fopen(&cacheName[0],"rb");
+	if(f==NULL) return false;
+	mzpfseek(f,0,SEEK_END);
+	f_off cacheSize=mzpftell(f);
+	mzpfseek(f,0,SEEK_SET);
+	if(cacheSize<(f_off)sizeof(h)){
+		fclose(f);
+		return false;
+	}
+	char* buf=new char[(size_t)cacheSize];
+	size_t sz=fread(buf,1,(size_t)cacheSize,f);
+	fclose(f);
+
+	memcpy(&h,buf,sizeof(h));
+	size_t n=(size_t)h.specCount+h.chromatCount;
+	if(sz!=(size_t)cacheSize || memcmp(h.magic,cur.magic,sizeof(h.magic))!=0 || h.version!=cur.version || h.byteOrder!=cur.byteOrder ||
+		h.fileSize!=cur.fileSize || h.fileTime!=cur.fileTime ||
+		(uint64_t)cacheSize!=sizeof(h)+n*sizeof(int64_t)+(n+1)*sizeof(uint32_t)+h.specCount*sizeof(int32_t)+h.poolSize){
+		delete [] buf;
+		return false;
+	}
+
+	int64_t* offsets=(int64_t*)(buf+sizeof(h));
+	uint32_t* pool=(uint32_t*)(offsets+n);
+	int32_t* scanNums=(int32_t*)(pool+n+1);
+	char* ids=(char*)(scanNums+h.specCount);
+
+	//reject pool positions that run backwards or past the idRef pool
+	bool bOK = pool[0]==0;
+	for(size_t i=0;bOK && i<n;i++) bOK = pool[i]<=pool[i+1];
+	if(!bOK || pool[n]>h.poolSize){
+		delete [] buf;
+		return false;
+	}
+
+	vSpec.clear();
+	vSpec.reserve(h.specCount,pool[h.specCount]+h.specCount);
+	for(uint32_t i=0;i<h.specCount;i++) vSpec.push_back(scanNums[i],(f_off)offsets[i],ids+pool[i],pool[i+1]-pool[i]);
+	vChromat.clear();
+	vChromat.reserve(h.chromatCount,pool[n]-pool[h.specCount]+h.chromatCount);
+	for(size_t i=h.specCount;i<n;i++) vChromat.push_back(0,(f_off)offsets[i],ids+pool[i],pool[i+1]-pool[i]);
+	offset=(f_off)h.indexOffset;
+
+	delete [] buf;
+	return true;
+}
+
+//Saves the indexes to the cache. Failure (e.g. a read-only directory) is not an
+//error; the indexes will simply be rebuilt on the next load.
+bool mzpSAXHandler::writeIndexCache(const mzpIndex& vSpec, const mzpIndex& vChromat, f_off offset){
+	if(!m_bIndexCache) return false;
+
+	mzpIndexCacheHeader h;
+	if(!mzpIndexCacheStat(m_strFileName,h)) return false;
+	h.indexOffset=(int64_t)offset;
+	h.specCount=(uint32_t)vSpec.size();
+	h.chromatCount=(uint32_t)vChromat.size();
+
+	size_t n=vSpec.size()+vChromat.size();
+	vector<int64_t> offsets(n);
+	vector<uint32_t> pool(n+1);
+	vector<int32_t> scanNums(vSpec.size());
+	string ids;
+	size_t i;
+	ids.reserve(vSpec.pool.size()+vChromat.pool.size());
+	for(i=0;i<vSpec.size();i++){
+		offsets[i]=(int64_t)vSpec.offset[i];
+		pool[i]=(uint32_t)ids.size();
+		scanNums[i]=vSpec.scanNum[i];
+		ids+=vSpec[i].idRef;
+	}
+	for(i=0;i<vChromat.size();i++){
+		offsets[vSpec.size()+i]=(int64_t)vChromat.offset[i];
+		pool[vSpec.size()+i]=(uint32_t)ids.size();
+		ids+=vChromat[i].idRef;
+	}
+	pool[n]=(uint32_t)ids.size();
+	h.poolSize=ids.size();
+
+	//write to a private name in the same directory and rename it into place, so that
+	//concurrent loads never see a partially written cache
+	string cacheName=m_strFileName+MZP_INDEX_CACHE_EXT;
+	char tmpExt[40];
+	size_t key=hash<thread::id>()(this_thread::get_id()) ^ (size_t)this ^ (size_t)chrono::high_resolution_clock::now().time_since_epoch().count();
+	sprintf(tmpExt,".%llx.tmp",(unsigned long long)key);
+	string tmpName=cacheName+tmpExt;
+	FILE* f=fopen(&tmpName[0],"wb");
+	if(f==NULL) return false;
+	bool bOK = fwrite(&h,sizeof(h),1,f)==1;
+	if(bOK && n>0) bOK = fwrite(&offsets[0],sizeof(int64_t),n,f)==n;
+	if(bOK) bOK = fwrite(&pool[0],sizeof(uint32_t),n+1,f)==n+1;
+	if(bOK && vSpec.size()>0) bOK = fwrite(&scanNums[0],sizeof(int32_t),vSpec.size(),f)==vSpec.size();
+	if(bOK && ids.size()>0) bOK = fwrite(&ids[0],1,ids.size(),f)==ids.size();
+	if(fclose(f)!=0) bOK=false;
+	if(bOK && rename(&tmpName[0],&cacheName[0])!=0){
+		remove(&cacheName[0]); //rename() does not replace an existing file on Windows
+		bOK = rename(&tmpName[0],&cacheName[0])==0;
+	}
+	if(!bOK) remove(&tmpName[0]);
+	return bOK;
+}
+
+void mzpSAXHandler::setIndexCache(bool b){
+	m_bIndexCache=b;
+}
+
+//------------------------------------------
+//  cindexRef
+//------------------------------------------
+cindexRef::operator cindex() const {
+	cindex c;
+	c.scanNum=scanNum;
+	c.idRef=idRef;
+	c.offset=offset;
+	return c;
+}
+
+//------------------------------------------
+//  mzpIndex
+//------------------------------------------
+mzpIndex::const_iterator::const_iterator(const mzpIndex* x, size_t i){
+	index=x;
+	pos=i;
+}
+cindexRef mzpIndex::const_iterator::operator*() const { return (*index)[pos];}
+mzpIndex::const_iterator& mzpIndex::const_iterator::operator++(){
+	pos++;
+	return *this;
+}
+mzpIndex::const_iterator mzpIndex::const_iterator::operator++(int){
+	const_iterator it=*this;
+	pos++;
+	return it;
+}
+bool mzpIndex::const_iterator::operator==(const const_iterator& it) const { return pos==it.pos && index==it.index;}
+bool mzpIndex::const_iterator::operator!=(const const_iterator& it) const { return !(*this==it);}
+
+cindexRef mzpIndex::operator[ ](const size_t i) const {
+	cindexRef c;
+	c.scanNum=scanNum[i];
+	c.idRef=&pool[idPos[i]];
+	c.offset=offset[i];
+	return c;
+}
+void mzpIndex::clear(){
+	offset.clear();
+	scanNum.clear();
+	idPos.clear();
+	pool.clear();
+}
+void mzpIndex::push_back(const cindex& c){ push_back(c.scanNum,c.offset,c.idRef.c_str(),c.idRef.size());}
+void mzpIndex::push_back(const cindexRef& c){ push_back(c.scanNum,c.offset,c.idRef,strlen(c.idRef));}
+void mzpIndex::push_back(int scan, f_off off, const char* id, size_t len){
+	offset.push_back(off);
+	scanNum.push_back(scan);
+	idPos.push_back((uint32_t)pool.size());
+	pool.append(id,len);
+	pool.push_back('\0');
+}
+void mzpIndex::reserve(size_t n, size_t poolSize){
+	offset.reserve(n);
+	scanNum.reserve(n);
+	idPos.reserve(n);
+	if(poolSize>0) pool.reserve(poolSize);
+}
+cindexRef mzpIndex::at(const size_t i) const {
+	if(i>=offset.size()) throw out_of_range("mzpIndex::at");
+	return (*this)[i];
+}
+cindexRef mzpIndex::back() const { return (*this)[offset.size()-1];}
+mzpIndex::const_iterator mzpIndex::begin() const { return const_iterator(this,0);}
+bool mzpIndex::empty() const { return offset.empty();}
+mzpIndex::const_iterator mzpIndex::end() const { return const_iterator(this,offset.size());}
+size_t mzpIndex::size() const { return offset.size();}
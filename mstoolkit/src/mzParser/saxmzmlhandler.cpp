@@ -40,6 +40,8 @@ mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs){
 	m_bInmzArrayBinary = false;
 	m_bInintenArrayBinary = false;
 	m_bInRefGroup = false;
+	m_bCentroid = false;
+	m_bLazyDecode = true;
 	m_bNetworkData = false; //always little-endian for mzML
   m_bNumpressLinear = false;
   m_bNumpressPic = false;
@@ -49,13 +51,23 @@ mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs){
 	m_bInChromatogramList=false;
 	m_bInIndexedMzML=false;
 	m_bInIndexList=false;
+	m_bInChromatogram=false;
 	m_bHeaderOnly=false;
+	m_bSkipBinary=false;
 	m_bSpectrumIndex=false;
 	m_bNoIndex=true;
   m_bZlib=false;
+  m_iArrays=arrayAll;
   m_iDataType=0;
+  m_iExtraArray=0;
 	spec=bs;
 	indexOffset=-1;
+	m_iLowScan=0;
+	m_iHighScan=0;
+	m_scanBuf=NULL;
+	m_scanBufSize=0;
+	m_streamFn=NULL;
+	m_streamData=NULL;
 	m_scanPRECCount = 0;
 	m_scanSPECCount = 0;
 	m_scanIDXCount = 0;
@@ -67,6 +79,8 @@ mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs, BasicChromatogram* cs){
 	m_bInmzArrayBinary = false;
 	m_bInintenArrayBinary = false;
 	m_bInRefGroup = false;
+	m_bCentroid = false;
+	m_bLazyDecode = true;
 	m_bNetworkData = false; //always little-endian for mzML
   m_bNumpressLinear = false;
   m_bNumpressPic = false;
@@ -76,14 +90,24 @@ mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs, BasicChromatogram* cs){
 	m_bInChromatogramList=false;
 	m_bInIndexedMzML=false;
 	m_bInIndexList=false;
+	m_bInChromatogram=false;
 	m_bHeaderOnly=false;
+	m_bSkipBinary=false;
 	m_bSpectrumIndex=false;
 	m_bNoIndex=true;
   m_bZlib=false;
+  m_iArrays=arrayAll;
   m_iDataType=0;
+  m_iExtraArray=0;
 	spec=bs;
 	chromat=cs;
 	indexOffset=-1;
+	m_iLowScan=0;
+	m_iHighScan=0;
+	m_scanBuf=NULL;
+	m_scanBufSize=0;
+	m_streamFn=NULL;
+	m_streamData=NULL;
 	m_scanPRECCount = 0;
 	m_scanSPECCount = 0;
 	m_scanIDXCount = 0;
@@ -92,147 +116,319 @@ mzpSAXMzmlHandler::mzpSAXMzmlHandler(BasicSpectrum* bs, BasicChromatogram* cs){
 mzpSAXMzmlHandler::~mzpSAXMzmlHandler(){
 	chromat=NULL;
 	spec=NULL;
+	if(m_scanBuf!=NULL) delete [] m_scanBuf;
+	clearWorkers();
+}
+
+//Perfect hash of the handled mzML element names: (5*length + first char + 10*last char) mod 32
+//is unique for every name below. Anything else lands in an empty slot or fails the single strcmp.
+static const struct { const char* name; int code; } mzmlElementTable[32] = {
+	{NULL,0}, //0
+	{"chromatogram",mzmlChromatogram}, //1
+	{NULL,0}, //2
+	{NULL,0}, //3
+	{"userParam",mzmlUserParam}, //4
+	{"referenceableParamGroup",mzmlReferenceableParamGroup}, //5
+	{NULL,0}, //6
+	{"binaryDataArray",mzmlBinaryDataArray}, //7
+	{"cvParam",mzmlCvParam}, //8
+	{"binaryDataArrayList",mzmlBinaryDataArrayList}, //9
+	{NULL,0}, //10
+	{NULL,0}, //11
+	{"componentList",mzmlComponentList}, //12
+	{"run",mzmlRun}, //13
+	{NULL,0}, //14
+	{NULL,0}, //15
+	{"referenceableParamGroupRef",mzmlReferenceableParamGroupRef}, //16
+	{"precursor",mzmlPrecursor}, //17
+	{"index",mzmlIndex}, //18
+	{NULL,0}, //19
+	{NULL,0}, //20
+	{"offset",mzmlOffset}, //21
+	{"softwareParam",mzmlSoftwareParam}, //22
+	{"spectrumList",mzmlSpectrumList}, //23
+	{"indexedmzML",mzmlIndexedmzML}, //24
+	{"precursorList",mzmlPrecursorList}, //25
+	{"binary",mzmlBinary}, //26
+	{"chromatogramList",mzmlChromatogramList}, //27
+	{NULL,0}, //28
+	{"spectrum",mzmlSpectrum}, //29
+	{"indexList",mzmlIndexList}, //30
+	{NULL,0}  //31
+};
+
+//Names of the handled cvParams, used only when a cvParam arrives without a usable accession.
+static const struct { const char* name; int code; } mzmlCvNameTable[] = {
+	{"32-bit float",1000521},
+	{"32-bit integer",1000519},
+	{"64-bit float",1000523},
+	{"64-bit integer",1000522},
+	{"base peak intensity",1000505},
+	{"base peak m/z",1000504},
+	{"centroid spectrum",1000127},
+	{"charge array",1000516},
+	{"charge state",1000041},
+	{"collision-induced dissociation",1000133},
+	{"collision energy",1000045},
+	{"electron multiplier",1000253},
+	{"electron transfer dissociation",1000598},
+	{"FAIMS compensation voltage",1001581},
+	{"filter string",1000512},
+	{"highest observed m/z",1000527},
+	{"inductive detector",1000624},
+	{"intensity array",1000515},
+	{"LTQ Velos",1000855},
+	{"lowest observed m/z",1000528},
+	{"mean inverse reduced ion mobility array",1003006},
+	{"mean ion mobility array",1002816},
+	{"mean ion mobility drift time array",1002477},
+	{"MS1 spectrum",1000579},
+	{"ms level",1000511},
+	{"MS-Numpress linear prediction compression",1002312},
+	{"MS-Numpress positive integer compression",1002313},
+	{"MS-Numpress short logged float compression",1002314},
+	{"m/z array",1000514},
+	{"nanoelectrospray",1000398},
+	{"non-standard data array",1000786},
+	{"orbitrap",1000484},
+	{"peak intensity",1000042},
+	{"positive scan",1000130},
+	{"profile spectrum",1000128},
+	{"radial ejection linear ion trap",1000083},
+	{"raw inverse reduced ion mobility array",1003008},
+	{"raw ion mobility array",1003007},
+	{"raw ion mobility drift time array",1003153},
+	{"scan start time",1000016},
+	{"scan window lower limit",1000501},
+	{"scan window upper limit",1000500},
+	{"selected ion m/z",1000744},
+	{"signal to noise array",1000517},
+	{"time array",1000595},
+	{"total ion current",1000285},
+	{"Thermo RAW file",1000563},
+	{"wavelength array",1000617},
+	{"zlib compression",1000574},
+	{"minute",MZP_CV_UO|31},
+	{NULL,0}
+};
+
+int mzpSAXMzmlHandler::elementCode(const XML_Char* el){
+	size_t len=strlen(el);
+	if(len==0) return mzmlOther;
+	int h=((int)len*5 + (unsigned char)el[0] + (unsigned char)el[len-1]*10) & 31;
+	if(mzmlElementTable[h].name==NULL || strcmp(mzmlElementTable[h].name,el)!=0) return mzmlOther;
+	return mzmlElementTable[h].code;
+}
+
+//Reduces "MS:nnnnnnn" and "UO:nnnnnnn" accessions to their integer code. If the
+//accession is missing or malformed, the optional name is looked up instead.
+int mzpSAXMzmlHandler::cvCode(const char* accession, const char* name){
+	int ont=-1;
+	if(accession[0]=='M' && accession[1]=='S' && accession[2]==':') ont=0;
+	else if(accession[0]=='U' && accession[1]=='O' && accession[2]==':') ont=MZP_CV_UO;
+	if(ont>=0 && accession[3]>='0' && accession[3]<='9'){
+		int n=0;
+		for(const char* c=accession+3;*c>='0' && *c<='9';c++) n=n*10+(*c-'0');
+		return n|ont;
+	}
+	if(name==NULL || name[0]=='\0') return 0;
+	for(int i=0;mzmlCvNameTable[i].name!=NULL;i++){
+		if(!strcmp(name,mzmlCvNameTable[i].name)) return mzmlCvNameTable[i].code;
+	}
+	return 0;
 }
 
 void mzpSAXMzmlHandler::startElement(const XML_Char *el, const XML_Char **attr){
 
-	if (isElement("binaryDataArray",el)){
-    m_bNumpressLinear=false;
-		string s=getAttrValue("encodedLength", attr);
-		m_encodedLen=atoi(&s[0]);
+	switch(elementCode(el)){
+	case mzmlBinaryDataArray:
+		{
+			m_bNumpressLinear=false;
+			string s=getAttrValue("encodedLength", attr);
+			m_encodedLen=atoi(&s[0]);
+		}
+		break;
 
-	} else if (isElement("binaryDataArrayList",el)) {
+	case mzmlBinaryDataArrayList:
 		if(m_bHeaderOnly) stopParser();
+		break;
+
+	case mzmlChromatogram:
+		{
+			string s=getAttrValue("id", attr);
+			chromat->setIDString(&s[0]);
+			m_peaksCount = atoi(getAttrValue("defaultArrayLength", attr));
+			m_binMZ.clear();
+			m_binIntensity.clear();
+			m_bInChromatogram=true;
+		}
+		break;
 
-	} else if (isElement("chromatogram",el)) {
-		string s=getAttrValue("id", attr);
-		chromat->setIDString(&s[0]);
-		m_peaksCount = atoi(getAttrValue("defaultArrayLength", attr));
-
-	} else if (isElement("chromatogramList",el)) {
+	case mzmlChromatogramList:
 		m_bInChromatogramList=true;
+		break;
 
-	} else if(isElement("index",el) && m_bInIndexList){
-		if(!strcmp(getAttrValue("name", attr),"spectrum")) m_bSpectrumIndex=true;
-		if(!strcmp(getAttrValue("name", attr),"chromatogram")) m_bChromatogramIndex=true;
+	case mzmlIndex:
+		if(m_bInIndexList){
+			if(!strcmp(getAttrValue("name", attr),"spectrum")) m_bSpectrumIndex=true;
+			if(!strcmp(getAttrValue("name", attr),"chromatogram")) m_bChromatogramIndex=true;
+		}
+		break;
 
-	} else if (isElement("indexedmzML",el)) {
+	case mzmlIndexedmzML:
 		m_vIndex.clear();
 		m_bInIndexedMzML=true;
+		break;
 
-	} else if(isElement("indexList",el)) {
+	case mzmlIndexList:
 		m_bInIndexList=true;
+		break;
+
+	case mzmlOffset:
+		//the idRef goes straight into the index pool; the offset is set at the end tag
+		if(m_bChromatogramIndex){
+			m_strData.clear();
+			const char* id=getAttrValue("idRef", attr);
+			m_vChromatIndex.push_back(0,0,id,strlen(id));
+		} else if(m_bSpectrumIndex){
+			m_strData.clear();
+			const char* id=getAttrValue("idRef", attr);
+			int scanNum;
+			if(strstr(id,"scan=")!=NULL)	{
+				scanNum=atoi(strstr(id,"scan=")+5);
+			} else if(strstr(id,"scanId=")!=NULL) {
+				scanNum=atoi(strstr(id,"scanId=")+7);
+			} else if(strstr(id,"S")!=NULL) {
+				scanNum=atoi(strstr(id,"S")+1);
+			} else {
+				scanNum=++m_scanIDXCount;
+				//Suppressing warning.
+				//cout << "WARNING: Cannot extract scan number in index offset line: " << id << "\tDefaulting to " << m_scanIDXCount << endl;
+			}
+			m_vIndex.push_back(scanNum,0,id,strlen(id));
+		}
+		break;
 
-	} else if(isElement("offset",el) && m_bChromatogramIndex){
-		m_strData.clear();
-		curIndex.idRef=string(getAttrValue("idRef", attr));
+	case mzmlPrecursor:
+		{
+			string s=getAttrValue("spectrumRef", attr);
 
-	} else if(isElement("offset",el) && m_bSpectrumIndex){
-		m_strData.clear();
-		curIndex.idRef=string(getAttrValue("idRef", attr));
-		if(strstr(&curIndex.idRef[0],"scan=")!=NULL)	{
-			curIndex.scanNum=atoi(strstr(&curIndex.idRef[0],"scan=")+5);
-		} else if(strstr(&curIndex.idRef[0],"scanId=")!=NULL) {
-			curIndex.scanNum=atoi(strstr(&curIndex.idRef[0],"scanId=")+7);
-		} else if(strstr(&curIndex.idRef[0],"S")!=NULL) {
-			curIndex.scanNum=atoi(strstr(&curIndex.idRef[0],"S")+1);
-		} else {
-			curIndex.scanNum=++m_scanIDXCount;
-			//Suppressing warning.
-			//cout << "WARNING: Cannot extract scan number in index offset line: " << &curIndex.idRef[0] << "\tDefaulting to " << m_scanIDXCount << endl;
+			//if spectrumRef is not provided
+			if(s.length()<1){
+				spec->setPrecursorScanNum(0);
+			} else {
+				if(strstr(&s[0],"scan=")!=NULL)	{
+					spec->setPrecursorScanNum(atoi(strstr(&s[0],"scan=")+5));
+				} else if(strstr(&s[0],"scanId=")!=NULL) {
+					spec->setPrecursorScanNum(atoi(strstr(&s[0],"scanId=")+7));
+				} else if(strstr(&s[0],"S")!=NULL) {
+					spec->setPrecursorScanNum(atoi(strstr(&s[0],"S")+1));
+				} else {
+					spec->setPrecursorScanNum(++m_scanPRECCount);
+					//Suppressing warning.
+					//cout << "WARNING: Cannot extract precursor scan number spectrum line: " << &s[0] << "\tDefaulting to " << m_scanPRECCount << endl;
+				}
+			}
 		}
+		break;
 
-	} else if(isElement("precursor",el)) {
-		string s=getAttrValue("spectrumRef", attr);
+	case mzmlReferenceableParamGroup:
+		{
+			const char* groupName = getAttrValue("id", attr);
+			m_ccurrentRefGroupName = string(groupName);
+			m_bInRefGroup = true;
+		}
+		break;
 
-		//if spectrumRef is not provided
-		if(s.length()<1){
-			spec->setPrecursorScanNum(0);
-		} else {
+	case mzmlRun:
+		stopParser();
+		break;
+
+	case mzmlSoftwareParam:
+		break;
+
+	case mzmlSpectrum:
+		{
+			string s=getAttrValue("id", attr);
+			spec->setIDString(&s[0]);
 			if(strstr(&s[0],"scan=")!=NULL)	{
-				spec->setPrecursorScanNum(atoi(strstr(&s[0],"scan=")+5));
+				spec->setScanNum(atoi(strstr(&s[0],"scan=")+5));
 			} else if(strstr(&s[0],"scanId=")!=NULL) {
-				spec->setPrecursorScanNum(atoi(strstr(&s[0],"scanId=")+7));
+				spec->setScanNum(atoi(strstr(&s[0],"scanId=")+7));
 			} else if(strstr(&s[0],"S")!=NULL) {
-				spec->setPrecursorScanNum(atoi(strstr(&s[0],"S")+1));
+				spec->setScanNum(atoi(strstr(&s[0],"S")+1));
 			} else {
-				spec->setPrecursorScanNum(++m_scanPRECCount);
+				spec->setScanNum(++m_scanSPECCount);
 				//Suppressing warning.
-				//cout << "WARNING: Cannot extract precursor scan number spectrum line: " << &s[0] << "\tDefaulting to " << m_scanPRECCount << endl;
+				//cout << "WARNING: Cannot extract scan number spectrum line: " << &s[0] << "\tDefaulting to " << m_scanSPECCount << endl;
 			}
+			m_peaksCount = atoi(getAttrValue("defaultArrayLength", attr));
+			spec->setPeaksCount(m_peaksCount);
+			m_binMZ.clear();
+			m_binIntensity.clear();
 		}
+		break;
 
-	}	else if (isElement("referenceableParamGroup", el)) {
-		const char* groupName = getAttrValue("id", attr);
-		m_ccurrentRefGroupName = string(groupName);
-		m_bInRefGroup = true;
-
-	} else if (isElement("run", el)){
-		stopParser();
-
-	}	else if (isElement("softwareParam", el)) {
-		const char* name = getAttrValue("name", attr);
-		const char* accession = getAttrValue("accession", attr);
-		const char* version = getAttrValue("version", attr);
-
-	}	else if (isElement("spectrum", el)) {
-		string s=getAttrValue("id", attr);
-		spec->setIDString(&s[0]);
-		if(strstr(&s[0],"scan=")!=NULL)	{
-			spec->setScanNum(atoi(strstr(&s[0],"scan=")+5));
-		} else if(strstr(&s[0],"scanId=")!=NULL) {
-			spec->setScanNum(atoi(strstr(&s[0],"scanId=")+7));
-		} else if(strstr(&s[0],"S")!=NULL) {
-			spec->setScanNum(atoi(strstr(&s[0],"S")+1));
-		} else {
-			spec->setScanNum(++m_scanSPECCount);
-			//Suppressing warning.
-			//cout << "WARNING: Cannot extract scan number spectrum line: " << &s[0] << "\tDefaulting to " << m_scanSPECCount << endl;
-		}
-		m_peaksCount = atoi(getAttrValue("defaultArrayLength", attr));
-		spec->setPeaksCount(m_peaksCount);
-
-	} else if (isElement("spectrumList",el)) {
+	case mzmlSpectrumList:
 		m_bInSpectrumList=true;
-
-	}	else if (isElement("cvParam", el)) {
-		const char* name = getAttrValue("name", attr);
-		const char* accession = getAttrValue("accession", attr);
-		const char* value = getAttrValue("value", attr);
-		const char* unitName = getAttrValue("unitName", attr);
-		const char* unitAccession = getAttrValue("unitAccession", attr);
-		if (m_bInRefGroup) {
-			cvParam m_cvParam;
-			m_cvParam.refGroupName = string(m_ccurrentRefGroupName);
-			m_cvParam.name = string(name);
-			m_cvParam.accession = string(accession);
-			m_cvParam.value = string(value);
-			m_cvParam.unitName = string(unitName);
-			m_cvParam.unitAccession = string(unitAccession);
-			m_refGroupCvParams.push_back(m_cvParam);
-		}	else {
-			processCVParam(name,accession,value,unitName,unitAccession);
-		}
-
-	}	else if (isElement("referenceableParamGroupRef", el))	{
-		const char* groupName = getAttrValue("ref", attr);
-		for (unsigned int i=0;i<m_refGroupCvParams.size();i++)	{
-			if( strcmp(groupName,&m_refGroupCvParams[i].refGroupName[0])==0 )	{
-				processCVParam(&m_refGroupCvParams[i].name[0], &m_refGroupCvParams[i].accession[0], &m_refGroupCvParams[i].value[0], &m_refGroupCvParams[i].unitName[0], &m_refGroupCvParams[i].unitAccession[0]);
+		break;
+
+	case mzmlCvParam:
+		{
+			const char* name = getAttrValue("name", attr);
+			const char* accession = getAttrValue("accession", attr);
+			const char* value = getAttrValue("value", attr);
+			const char* unitName = getAttrValue("unitName", attr);
+			const char* unitAccession = getAttrValue("unitAccession", attr);
+			if (m_bInRefGroup) {
+				cvParam m_cvParam;
+				m_cvParam.refGroupName = string(m_ccurrentRefGroupName);
+				m_cvParam.name = string(name);
+				m_cvParam.accession = string(accession);
+				m_cvParam.value = string(value);
+				m_cvParam.unitName = string(unitName);
+				m_cvParam.unitAccession = string(unitAccession);
+				m_cvParam.cvCode = cvCode(accession,name);
+				m_cvParam.unitCode = cvCode(unitAccession,unitName);
+				m_refGroupCvParams.push_back(m_cvParam);
+			}	else {
+				processCVParam(cvCode(accession,name),name,value,cvCode(unitAccession,unitName));
 			}
 		}
-
-  }	else if (isElement("userParam", el))	{
-		const char* name = getAttrValue("name", attr);
-		const char* dtype = getAttrValue("type", attr);
-		const char* value = getAttrValue("value", attr);
-    if(strcmp(name,"[Thermo Trailer Extra]Monoisotopic M/Z:")==0){
-      spec->setPrecursorMonoMZ(atof(value));
+		break;
+
+	case mzmlReferenceableParamGroupRef:
+		{
+			const char* groupName = getAttrValue("ref", attr);
+			for (unsigned int i=0;i<m_refGroupCvParams.size();i++)	{
+				if( strcmp(groupName,&m_refGroupCvParams[i].refGroupName[0])==0 )	{
+					processCVParam(m_refGroupCvParams[i].cvCode, &m_refGroupCvParams[i].name[0], &m_refGroupCvParams[i].value[0], m_refGroupCvParams[i].unitCode);
+				}
+			}
 		}
-	}
+		break;
+
+	case mzmlUserParam:
+		{
+			const char* name = getAttrValue("name", attr);
+			const char* value = getAttrValue("value", attr);
+			if(strcmp(name,"[Thermo Trailer Extra]Monoisotopic M/Z:")==0){
+				spec->setPrecursorMonoMZ(atof(value));
+			}
+		}
+		break;
 
-	if(isElement("binary", el))	{
+	case mzmlBinary:
 		m_strData.clear();
+		if(!m_bInChromatogram){
+			if(m_bInmzArrayBinary) m_bSkipBinary=!(m_iArrays&arrayMZ);
+			else if(m_bInintenArrayBinary) m_bSkipBinary=!(m_iArrays&arrayIntensity);
+			else if(m_iExtraArray!=0) m_bSkipBinary=!(m_iArrays&m_iExtraArray);
+		} else if(m_iExtraArray!=0) m_bSkipBinary=true;
+		break;
+
+	default:
+		break;
 	}
 
 }
@@ -240,267 +436,347 @@ void mzpSAXMzmlHandler::startElement(const XML_Char *el, const XML_Char **attr){
 
 void mzpSAXMzmlHandler::endElement(const XML_Char *el) {
 
-	if(isElement("binary", el))	{
-		processData();
+	switch(elementCode(el)){
+	case mzmlBinary:
+		if(!m_bSkipBinary) processData();
 		m_strData.clear();
+		m_bSkipBinary=false;
+		break;
 
-  } else if(isElement("binaryDataArray", el))	{
-    m_bZlib=false;
-    m_bInintenArrayBinary = false;
+	case mzmlBinaryDataArray:
+		m_bZlib=false;
+		m_bInintenArrayBinary = false;
 		m_bInmzArrayBinary = false;
-    m_bNumpressLinear=false;
-    m_bNumpressSlof=false;
-    m_bNumpressPic=false;
-    m_iDataType=0;
-
-	} else if(isElement("chromatogram",el)) {
+		m_bNumpressLinear=false;
+		m_bNumpressSlof=false;
+		m_bNumpressPic=false;
+		m_iDataType=0;
+		m_iExtraArray=0;
+		break;
+
+	case mzmlChromatogram:
+		m_bInChromatogram=false;
 		pushChromatogram();
 		stopParser();
+		break;
 
-	} else if(isElement("chromatogramList",el)) {
+	case mzmlChromatogramList:
 		m_bInChromatogramList=false;
+		break;
 
-	} else if(isElement("componentList",el)) {
+	case mzmlComponentList:
 		m_vInstrument.push_back(m_instrument);
+		break;
 
-	} else if(isElement("index",el)){
+	case mzmlIndex:
 		m_bSpectrumIndex=false;
 		m_bChromatogramIndex=false;
+		break;
 
-	} else if(isElement("indexList",el)){
+	case mzmlIndexList:
 		m_bInIndexList=false;
 		stopParser();
+		break;
 
-	} else if(isElement("offset",el) && m_bChromatogramIndex){
-		curChromatIndex.offset=mzpatoi64(&m_strData[0]);
-		m_vChromatIndex.push_back(curChromatIndex);
-
-	} else if(isElement("offset",el) && m_bSpectrumIndex){
-		curIndex.offset=mzpatoi64(&m_strData[0]);
-		m_vIndex.push_back(curIndex);
+	case mzmlOffset:
+		if(m_bChromatogramIndex){
+			m_vChromatIndex.offset.back()=mzpatoi64(&m_strData[0]);
+		} else if(m_bSpectrumIndex){
+			m_vIndex.offset.back()=mzpatoi64(&m_strData[0]);
+		}
+		break;
 
-	} else if(isElement("precursorList",el)){
-		
-	} else if (isElement("referenceableParamGroup", el)) {
+	case mzmlReferenceableParamGroup:
 		m_bInRefGroup = false;
+		break;
 
-	}	else if(isElement("spectrum", el)) {
+	case mzmlSpectrum:
 		pushSpectrum();
 		stopParser();
-		
-	} else if(isElement("spectrumList",el)) {
+		break;
+
+	case mzmlSpectrumList:
 		m_bInSpectrumList = false;
+		break;
 
+	default:
+		break;
 	}
 }
 
 void mzpSAXMzmlHandler::characters(const XML_Char *s, int len) {
+	if(m_bSkipBinary) return;
 	m_strData.append(s, len);
 }
 
-void mzpSAXMzmlHandler::processCVParam(const char* name, const char* accession, const char* value, const char* unitName, const char* unitAccession)
+void mzpSAXMzmlHandler::processCVParam(int code, const char* name, const char* value, int unitCode)
 {
-	if(!strcmp(name, "32-bit float") || !strcmp(accession,"MS:1000521"))	{
+	switch(code){
+	case 1000521: //32-bit float
 		m_bLowPrecision = true;
-    m_iDataType=1;
+		m_iDataType=1;
+		break;
 
-	} else if(!strcmp(name, "64-bit float") || !strcmp(accession,"MS:1000523"))	{
+	case 1000523: //64-bit float
 		m_bLowPrecision = false;
-    m_iDataType=2;
+		m_iDataType=2;
+		break;
+
+	case 1000519: //32-bit integer
+		m_iDataType=3;
+		break;
 
-	} else if(!strcmp(name, "base peak intensity") || !strcmp(accession,"MS:1000505"))	{
+	case 1000522: //64-bit integer
+		m_iDataType=4;
+		break;
+
+	case 1000505: //base peak intensity
 		spec->setBasePeakIntensity(atof(value));
+		break;
 
-	} else if(!strcmp(name, "base peak m/z") || !strcmp(accession,"MS:1000504"))	{
+	case 1000504: //base peak m/z
 		spec->setBasePeakMZ(atof(value));
-		
-	} else if(!strcmp(name, "centroid spectrum") || !strcmp(accession,"MS:1000127")) {
+		break;
+
+	case 1000127: //centroid spectrum
 		spec->setCentroid(true);
+		break;
+
+	case 1000516: //charge array
+	case 1000786: //non-standard data array, named by its value
+	case 1000517: //signal to noise array
+	case 1000617: //wavelength array
+		m_bInmzArrayBinary = false;
+		m_bInintenArrayBinary = false;
+		m_iExtraArray=arrayOther;
+		m_strArrayName = code==1000786 ? value : name;
+		break;
 
-	} else if(!strcmp(name, "charge state") || !strcmp(accession,"MS:1000041"))	{
+	case 1000041: //charge state
 		spec->setPrecursorCharge(atoi(value));
+		break;
 
-	} else if(!strcmp(name, "collision-induced dissociation") || !strcmp(accession,"MS:1000133"))	{
+	case 1000133: //collision-induced dissociation
 		if(spec->getActivation()==ETD) spec->setActivation(ETDSA);
 		else spec->setActivation(CID);
+		break;
 
-	} else if(!strcmp(name, "collision energy") || !strcmp(accession,"MS:1000045"))	{
+	case 1000045: //collision energy
 		spec->setCollisionEnergy(atof(value));
+		break;
 
-	} else if(!strcmp(name,"electron multiplier") || !strcmp(accession,"MS:1000253")) {
+	case 1000253: //electron multiplier
+	case 1000624: //inductive detector
 		m_instrument.detector=name;
+		break;
 
-	} else if(!strcmp(name, "electron transfer dissociation") || !strcmp(accession,"MS:1000598"))	{
+	case 1000598: //electron transfer dissociation
 		if(spec->getActivation()==CID) spec->setActivation(ETDSA);
 		else spec->setActivation(ETD);
+		break;
 
-	} else if(!strcmp(name, "FAIMS compensation voltage") || !strcmp(accession,"MS:1001581"))	{
+	case 1001581: //FAIMS compensation voltage
 		spec->setCompensationVoltage(atof(value));
-		
-	} else if(!strcmp(name, "filter string") || !strcmp(accession,"MS:1000512"))	{
-		char str[128];
-		strncpy(str,value,127);
-		str[127]='\0';
-		spec->setFilterLine(str);
-
-	} else if(!strcmp(name, "highest observed m/z") || !strcmp(accession,"MS:1000527"))	{
-		spec->setHighMZ(atof(value));
+		break;
+
+	case 1000512: //filter string
+		{
+			char str[128];
+			strncpy(str,value,127);
+			str[127]='\0';
+			spec->setFilterLine(str);
+		}
+		break;
 
-	} else if(!strcmp(name,"inductive detector") || !strcmp(accession,"MS:1000624")) {
-		m_instrument.detector=name;
+	case 1000527: //highest observed m/z
+		spec->setHighMZ(atof(value));
+		break;
 
-	} else if(!strcmp(name, "intensity array") || !strcmp(accession,"MS:1000515"))	{
+	case 1000515: //intensity array
 		m_bInintenArrayBinary = true;
 		m_bInmzArrayBinary = false;
+		break;
+
+	case 1003006: //mean inverse reduced ion mobility array
+	case 1002816: //mean ion mobility array
+	case 1002477: //mean ion mobility drift time array
+	case 1003008: //raw inverse reduced ion mobility array
+	case 1003007: //raw ion mobility array
+	case 1003153: //raw ion mobility drift time array
+		m_bInmzArrayBinary = false;
+		m_bInintenArrayBinary = false;
+		m_iExtraArray=arrayIonMobility;
+		m_strArrayName = name;
+		break;
 
-	} else if(!strcmp(name,"LTQ Velos") || !strcmp(accession,"MS:1000855")) {
+	case 1000855: //LTQ Velos
 		m_instrument.model=name;
+		break;
 
-	} else if(!strcmp(name, "lowest observed m/z") || !strcmp(accession,"MS:1000528"))	{
+	case 1000528: //lowest observed m/z
 		spec->setLowMZ(atof(value));
+		break;
 
-	} else if( !strcmp(name, "MS1 spectrum") || !strcmp(accession,"MS:1000579") ){
+	case 1000579: //MS1 spectrum
 		spec->setMSLevel(1);
+		break;
 
-	} else if( !strcmp(name, "ms level") || !strcmp(accession,"MS:1000511") ){
+	case 1000511: //ms level
 		spec->setMSLevel(atoi(value));
+		break;
 
-	} else if( !strcmp(name, "MS-Numpress linear prediction compression") || !strcmp(accession,"MS:1002312") ){
-    m_bNumpressLinear = true;
+	case 1002312: //MS-Numpress linear prediction compression
+		m_bNumpressLinear = true;
+		break;
 
-  } else if( !strcmp(name, "MS-Numpress positive integer compression") || !strcmp(accession,"MS:1002313") ){
-    m_bNumpressPic = true;
+	case 1002313: //MS-Numpress positive integer compression
+		m_bNumpressPic = true;
+		break;
 
-  } else if( !strcmp(name, "MS-Numpress short logged float compression") || !strcmp(accession,"MS:1002314") ){
-    m_bNumpressSlof = true;
+	case 1002314: //MS-Numpress short logged float compression
+		m_bNumpressSlof = true;
+		break;
 
-	} else if(!strcmp(name, "m/z array") || !strcmp(accession,"MS:1000514"))	{
+	case 1000514: //m/z array
 		m_bInmzArrayBinary = true;
 		m_bInintenArrayBinary = false;
+		break;
 
-	} else if(!strcmp(name,"nanoelectrospray") || !strcmp(accession,"MS:1000398")) {
+	case 1000398: //nanoelectrospray
 		m_instrument.ionization=name;
+		break;
 
-	} else if(!strcmp(name,"orbitrap") || !strcmp(accession,"MS:1000484")) {
+	case 1000484: //orbitrap
+	case 1000083: //radial ejection linear ion trap
 		m_instrument.analyzer=name;
+		break;
 
-	} else if(!strcmp(name,"peak intensity") || !strcmp(accession,"MS:1000042")) {
+	case 1000042: //peak intensity
 		spec->setPrecursorIntensity(atof(value));
+		break;
 
-	} else if(!strcmp(name,"positive scan") || !strcmp(accession,"MS:1000130")) {
+	case 1000130: //positive scan
 		spec->setPositiveScan(true);
+		break;
 
-	} else if(!strcmp(name,"profile spectrum") || !strcmp(accession,"MS:1000128")) {
+	case 1000128: //profile spectrum
 		spec->setCentroid(false);
+		break;
 
-	} else if(!strcmp(name,"radial ejection linear ion trap") || !strcmp(accession,"MS:1000083")) {
-		m_instrument.analyzer=name;
-
-	} else if(!strcmp(name, "scan start time") || !strcmp(accession,"MS:1000016"))	{
-		if(!strcmp(unitName, "minute") || !strcmp(unitAccession,"UO:0000031"))	{
+	case 1000016: //scan start time
+		if(unitCode==(MZP_CV_UO|31))	{ //minute
 			spec->setRTime((float)atof(value));
 		} else {
 			spec->setRTime((float)atof(value)/60.0f); //assume if not minutes, then seconds
 		}
+		break;
 
-	} else if(!strcmp(name, "scan window lower limit") || !strcmp(accession,"MS:1000501"))    {
+	case 1000501: //scan window lower limit
 		//TODO: should we also check the units???
 		spec->setLowMZ(atof(value));
-		
-	} else if(!strcmp(name, "scan window upper limit") || !strcmp(accession,"MS:1000500"))    {
+		break;
+
+	case 1000500: //scan window upper limit
 		//TODO: should we also check the units???
-	    spec->setHighMZ(atof(value));
-		
-	} else if(!strcmp(name, "selected ion m/z") || !strcmp(accession,"MS:1000744"))	{
+		spec->setHighMZ(atof(value));
+		break;
+
+	case 1000744: //selected ion m/z
 		spec->setPrecursorMZ(atof(value));
+		break;
 
-	} else if(!strcmp(name, "time array") || !strcmp(accession,"MS:1000595"))	{
+	case 1000595: //time array
 		m_bInmzArrayBinary = true; //note that this uses the m/z designation, although it is a time series
 		m_bInintenArrayBinary = false;
+		break;
 
-	} else if(!strcmp(name, "total ion current") || !strcmp(accession,"MS:1000285"))	{
+	case 1000285: //total ion current
 		spec->setTotalIonCurrent(atof(value));
+		break;
 
-	} else if(!strcmp(name,"Thermo RAW file") || !strcmp(accession,"MS:1000563")) {
+	case 1000563: //Thermo RAW file
 		m_instrument.manufacturer="Thermo Scientific";
+		break;
 
-	} else if(!strcmp(name, "zlib compression") || !strcmp(accession,"MS:1000574"))	{
+	case 1000574: //zlib compression
 		m_bZlib=true;
+		break;
+
+	default:
+		break;
 	}
 }
 
+//Keeps the encoded text of the array just read; it is decoded when the spectrum
+//or chromatogram is pushed, or later by BasicSpectrum with m_bLazyDecode. Extra
+//arrays of a spectrum go straight to it as named columns.
 void mzpSAXMzmlHandler::processData()
 {
-	if(m_bInmzArrayBinary) {
-    decode(vdM);
-		//if(m_bLowPrecision && !m_bCompressedData) decode32(vdM);
-		//else if(m_bLowPrecision && m_bCompressedData) decompress32(vdM);
-		//else if(!m_bLowPrecision && !m_bCompressedData) decode64(vdM);
-		//else decompress64(vdM);
-	} else if(m_bInintenArrayBinary) {
-    decode(vdI);
-		//if(m_bLowPrecision && !m_bCompressedData) decode32(vdI);
-		//else if(m_bLowPrecision && m_bCompressedData) decompress32(vdI);
-		//else if(!m_bLowPrecision && !m_bCompressedData) decode64(vdI);
-		//else decompress64(vdI);
-	}
-	//m_bCompressedData=false;
+	mzpBinaryArray extra;
+	mzpBinaryArray* a;
+	if(m_bInmzArrayBinary) a=&m_binMZ;
+	else if(m_bInintenArrayBinary) a=&m_binIntensity;
+	else if(m_iExtraArray!=0) a=&extra;
+	else return;
+
+	a->data.swap(m_strData);
+	a->dataType=m_iDataType;
+	a->encodedLength=m_encodedLen;
+	a->numpressLinear=m_bNumpressLinear;
+	a->numpressPic=m_bNumpressPic;
+	a->numpressSlof=m_bNumpressSlof;
+	a->peaksCount=m_peaksCount;
+	a->zlib=m_bZlib;
+
+	if(a==&extra){
+		spec->addArray(&m_strArrayName[0],extra);
+		if(!m_bLazyDecode) spec->getArray(spec->getArrayCount()-1);
+	}
 }
 
 bool mzpSAXMzmlHandler::readChromatogram(int num){
 	if(chromat==NULL) return false;
 	chromat->clear();
 
-	if(m_bNoIndex){
-		cout << "Currently only supporting indexed mzML" << endl;
-		return false;
-	}
+	if(m_bNoIndex) return false;
 
 	//if no scan was requested, grab the next one
 	if(num<0) posChromatIndex++;
 	else posChromatIndex=num;
 	
 	if(posChromatIndex>=(int)m_vChromatIndex.size()) return false;
-	parseOffset(m_vChromatIndex[posChromatIndex].offset);
+	parseOffset(m_vChromatIndex[posChromatIndex].offset,chromatogramSpan(posChromatIndex));
 	return true;
 }
 
 bool mzpSAXMzmlHandler::readHeader(int num){
 	spec->clear();
 
-	if(m_bNoIndex){
-		cout << "Currently only supporting indexed mzML" << endl;
-		return false;
-	}
+	if(m_bNoIndex) return false;
 
 	//if no scan was requested, grab the next one
 	if(num<0){
 		posIndex++;
 		if(posIndex>=(int)m_vIndex.size()) return false;
+		if(m_headerTable.size()>0){
+			m_headerTable.getRow(posIndex,*spec);
+			return true;
+		}
 		m_bHeaderOnly=true;
-		parseOffset(m_vIndex[posIndex].offset);
+		if(!scanSpectrum(m_vIndex[posIndex].offset,spectrumSpan(posIndex,true))) parseOffset(m_vIndex[posIndex].offset,spectrumSpan(posIndex,true));
 		m_bHeaderOnly=false;
 		return true;
 	}
 
-	//Assumes scan numbers are in order
-	int mid=m_vIndex.size()/2;
-	int upper=m_vIndex.size();
-	int lower=0;
-	while(m_vIndex[mid].scanNum!=num){
-		if(lower==upper) break;
-		if(m_vIndex[mid].scanNum>num){
-			upper=mid-1;
-			mid=(lower+upper)/2;
-		} else {
-			lower=mid+1;
-			mid=(lower+upper)/2;
-		}
+	int mid=findScan(num);
+	if(mid>=0 && m_headerTable.size()>0) {
+		m_headerTable.getRow(mid,*spec);
+		posIndex=mid;
+		return true;
 	}
-
-	if(m_vIndex[mid].scanNum==num) {
+	if(mid>=0) {
 		m_bHeaderOnly=true;
-		parseOffset(m_vIndex[mid].offset);
+		if(!scanSpectrum(m_vIndex[mid].offset,spectrumSpan(mid,true))) parseOffset(m_vIndex[mid].offset,spectrumSpan(mid,true));
 		//force scan number; this was done for files where scan events are not numbered
 		if(spec->getScanNum()!=m_vIndex[mid].scanNum) spec->setScanNum(m_vIndex[mid].scanNum);
 		spec->setScanIndex(mid+1); //set the index, which starts from 1, so offset by 1
@@ -512,52 +788,143 @@ bool mzpSAXMzmlHandler::readHeader(int num){
 
 }
 
+//One spectrum asked of readSpectra()
+struct mzpSpectrumRequest {
+	f_off offset;
+	int		pos;		//index position
+	int		req;		//position in the request
+	bool operator<(const mzpSpectrumRequest& r) const { return offset<r.offset || (offset==r.offset && req<r.req); }
+};
+
+//Reads several spectra, by scan number, into specs in the order they were asked for.
+//The requests are sorted by file offset, and each run of spectra that follow one
+//another in the file is read at once and scanned in place, spectrum by spectrum,
+//without seeking or resetting a parser in between. Returns false if any scan number
+//is not in the index; its spectrum is left empty.
+bool mzpSAXMzmlHandler::readSpectra(const vector<int>& scans, vector<BasicSpectrum>& specs){
+	size_t i,j,k;
+	bool ok=true;
+
+	specs.resize(scans.size());
+	for(i=0;i<specs.size();i++) specs[i].clear();
+	if(m_bNoIndex) return false;
+
+	vector<mzpSpectrumRequest> vReq;
+	vReq.reserve(scans.size());
+	for(i=0;i<scans.size();i++){
+		mzpSpectrumRequest r;
+		r.pos=findScan(scans[i]);
+		if(r.pos<0) {
+			ok=false;
+			continue;
+		}
+		r.offset=m_vIndex[r.pos].offset;
+		r.req=(int)i;
+		vReq.push_back(r);
+	}
+	sort(vReq.begin(),vReq.end());
+
+	BasicSpectrum* s=spec;
+	for(i=0;i<vReq.size();i=j){
+
+		//extend the run while the next request is the spectrum that follows in the file
+		int last=vReq[i].pos;
+		f_off len=spectrumSpan(last);
+		for(j=i+1;j<vReq.size() && len>0;j++){
+			if(vReq[j].pos==last) continue;
+			int span=spectrumSpan(vReq[j].pos);
+			if(vReq[j].pos!=last+1 || vReq[j].offset!=vReq[i].offset+len || span==0 || len+span>MAXSPAN) break;
+			last=vReq[j].pos;
+			len+=span;
+		}
+
+		//a spectrum of unknown length is read on its own
+		if(len==0){
+			for(j=i;j<vReq.size() && vReq[j].pos==vReq[i].pos;j++){
+				spec=&specs[vReq[j].req];
+				if(j>i) *spec=specs[vReq[i].req];
+				else if(!scanSpectrum(vReq[i].offset)) parseOffset(vReq[i].offset);
+				if(spec->getScanNum()!=m_vIndex[vReq[j].pos].scanNum) spec->setScanNum(m_vIndex[vReq[j].pos].scanNum);
+				spec->setScanIndex(vReq[j].pos+1);
+			}
+			continue;
+		}
+
+		if(m_scanBufSize<len+1){
+			delete [] m_scanBuf;
+			m_scanBufSize=(int)len+1;
+			m_scanBuf=new char[m_scanBufSize];
+		}
+		int got=0;
+		int readBytes;
+		seekFile(vReq[i].offset);
+		while(got<len && (readBytes=readFile(m_scanBuf+got,(int)len-got))>0) got+=readBytes;
+
+		for(k=i;k<j;k++){
+			spec=&specs[vReq[k].req];
+			if(k>i && vReq[k].pos==vReq[k-1].pos) {
+				*spec=specs[vReq[k-1].req];
+				continue;
+			}
+			int span=spectrumSpan(vReq[k].pos);
+			f_off from=vReq[k].offset-vReq[i].offset;
+			char* p=m_scanBuf+from;
+			char* end=m_scanBuf+(from+span<got ? from+span : got);
+			if(p>=end || !scanSpectrumText(p,end)) parseOffset(vReq[k].offset,span);
+			if(spec->getScanNum()!=m_vIndex[vReq[k].pos].scanNum) spec->setScanNum(m_vIndex[vReq[k].pos].scanNum);
+			spec->setScanIndex(vReq[k].pos+1);
+		}
+	}
+	spec=s;
+	return ok;
+}
+
 bool mzpSAXMzmlHandler::readSpectrum(int num){
 	spec->clear();
 
-	if(m_bNoIndex){
-		cout << "Currently only supporting indexed mzML" << endl;
-		return false;
-	}
+	if(m_bNoIndex) return false;
 
 	//if no scan was requested, grab the next one
 	if(num<0){
 		posIndex++;
 		if(posIndex>=(int)m_vIndex.size()) return false;
-		parseOffset(m_vIndex[posIndex].offset);
+		if(!scanSpectrum(m_vIndex[posIndex].offset,spectrumSpan(posIndex))) parseOffset(m_vIndex[posIndex].offset,spectrumSpan(posIndex));
 		return true;
 	}
 
-	//Assumes scan numbers are in order
-	int mid=m_vIndex.size()/2;
-	int upper=m_vIndex.size();
-	int lower=0;
-	while(m_vIndex[mid].scanNum!=num){
-		if(lower==upper) break;
-		if(m_vIndex[mid].scanNum>num){
-			upper=mid-1;
-			mid=(lower+upper)/2;
-		} else {
-			lower=mid+1;
-			mid=(lower+upper)/2;
-		}
+	int mid=findScan(num);
+	if(mid>=0) {
+		if(!scanSpectrum(m_vIndex[mid].offset,spectrumSpan(mid))) parseOffset(m_vIndex[mid].offset,spectrumSpan(mid));
+		//force scan number; this was done for files where scan events are not numbered
+		if(spec->getScanNum()!=m_vIndex[mid].scanNum) spec->setScanNum(m_vIndex[mid].scanNum);
+		spec->setScanIndex(mid+1); //set the index, which starts from 1, so offset by 1
+		posIndex=mid;
+		return true;
 	}
+	return false;
+}
 
-	//need something faster than this perhaps
-	//for(unsigned int i=0;i<m_vIndex.size();i++){
-		if(m_vIndex[mid].scanNum==num) {
-			parseOffset(m_vIndex[mid].offset);
-			//force scan number; this was done for files where scan events are not numbered
-			if(spec->getScanNum()!=m_vIndex[mid].scanNum) spec->setScanNum(m_vIndex[mid].scanNum);
-			spec->setScanIndex(mid+1); //set the index, which starts from 1, so offset by 1
-			posIndex=mid;
-			return true;
-		}
-	//}
+//Reads the next spectrum after the current one that passes f. f is checked against
+//the header table, built on first use, so rejected spectra are never read.
+bool mzpSAXMzmlHandler::readSpectrum(const mzpSpectrumFilter& f){
+	spec->clear();
+
+	if(m_bNoIndex) return false;
+	if(m_headerTable.size()==0 && !scanHeaders()) return false;
+
+	while(++posIndex<(int)m_vIndex.size()){
+		if(!f.pass(m_headerTable.msLevel[posIndex],m_headerTable.rTime[posIndex],m_headerTable.precursorMZ[posIndex],m_headerTable.activation[posIndex])) continue;
+		if(!scanSpectrum(m_vIndex[posIndex].offset,spectrumSpan(posIndex))) parseOffset(m_vIndex[posIndex].offset,spectrumSpan(posIndex));
+		if(spec->getScanNum()!=m_vIndex[posIndex].scanNum) spec->setScanNum(m_vIndex[posIndex].scanNum);
+		spec->setScanIndex(posIndex+1);
+		return true;
+	}
 	return false;
 }
 
 void mzpSAXMzmlHandler::pushChromatogram(){
+	m_binMZ.decode(vdM);
+	m_binIntensity.decode(vdI);
 	TimeIntensityPair tip;
 	for(unsigned int i=0;i<vdM.size();i++)	{
 		tip.time = vdM[i];
@@ -568,163 +935,222 @@ void mzpSAXMzmlHandler::pushChromatogram(){
 
 void mzpSAXMzmlHandler::pushSpectrum(){
 
+	//centroiding and peak selection need the decoded arrays
+	bool bCentroid = m_bCentroid && !spec->getCentroid();
+	if(m_bLazyDecode && !bCentroid && !m_topPeaks.active()){
+		spec->setBinaryData(m_binMZ,m_binIntensity);
+		return;
+	}
+
+	m_binMZ.decode(vdM);
+	m_binIntensity.decode(vdI);
+
+	//an array left out by setArrays() is zero, and gives no statistics
+	bool bStats = vdM.size()==vdI.size();
+	if(vdM.size()<vdI.size()) vdM.resize(vdI.size(),0);
+	else if(vdI.size()<vdM.size()) vdI.resize(vdM.size(),0);
+
+	if(bCentroid){
+		m_centroider.centroid(vdM,vdI);
+		spec->setCentroid(true);
+	}
+
+	//TIC, base peak, and m/z extent are gathered as the points are stored, and
+	//describe the whole spectrum even when only the top peaks are kept
+	bool bSelect=m_topPeaks.active();
+	if(bSelect) m_topPeaks.select(vdM,vdI);
 	specDP dp;
+	mzpPeakStats stats;
 	for(unsigned int i=0;i<vdM.size();i++)	{
 		dp.mz = vdM[i];
 		dp.intensity = vdI[i];
+		stats.add(dp.mz,dp.intensity);
+		if(bSelect && !m_topPeaks.keep[i]) continue;
 		spec->addDP(dp);
 	}
+	if(bStats) stats.store(*spec);
+
+	//extra arrays keep the same points, taking the value at each centroid's maximum
+	for(int a=0;a<spec->getArrayCount();a++){
+		if(bCentroid) m_centroider.compact(spec->getArray(a));
+		if(bSelect) m_topPeaks.compact(spec->getArray(a));
+	}
 	
 }
 
-void mzpSAXMzmlHandler::decode(vector<double>& d){
-
-  //If there is no data, back out now
-  d.clear();
-	if(m_peaksCount < 1) return;
-
-  //For byte order correction
-	union udata32 {
-		float d;
-		uint32_t i;  
-	} uData32; 
-
-  union udata64 {
-	  double d;
-		uint64_t i;  
-	} uData64; 
-
-	const char* pData = m_strData.data();
-	size_t stringSize = m_strData.size();
-
-  char* decoded = new char[m_encodedLen];  //array for decoded base64 string
-  int decodeLen;
-  Bytef* unzipped;
-  uLong unzippedLen;
-
-  int i;
-
-  //Base64 decoding
-  decodeLen = b64_decode_mio(decoded,(char*)pData,stringSize);
-
-  //zlib decompression
-  if(m_bZlib) {
-
-    if(m_iDataType==1) {
-      unzippedLen = m_peaksCount*sizeof(uint32_t);
-    } else if(m_iDataType==2) {
-      unzippedLen = m_peaksCount*sizeof(uint64_t);
-    } else {
-      if(!m_bNumpressLinear && !m_bNumpressSlof && !m_bNumpressPic){
-        cout << "Unknown data format to unzip. Stopping file read." << endl;
-        exit(EXIT_FAILURE);
-      }
-	  //don't know the unzipped size of numpressed data, so assume it to be no larger than unpressed 64-bit data
-	  unzippedLen = m_peaksCount*sizeof(uint64_t);
-    }
-
-    unzipped = new Bytef[unzippedLen];
-	  uncompress((Bytef*)unzipped, &unzippedLen, (const Bytef*)decoded, (uLong)decodeLen);
-	  delete [] decoded;
-
-  }
-
-  //Numpress decompression
-  if(m_bNumpressLinear || m_bNumpressSlof || m_bNumpressPic){
-    double* unpressed=new double[m_peaksCount];
-  
-	try{
-      if(m_bNumpressLinear){
-        if(m_bZlib) ms::numpress::MSNumpress::decodeLinear((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
-        else ms::numpress::MSNumpress::decodeLinear((unsigned char*)decoded,decodeLen,unpressed);
-      } else if(m_bNumpressSlof){
-        if(m_bZlib) ms::numpress::MSNumpress::decodeSlof((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
-        else ms::numpress::MSNumpress::decodeSlof((unsigned char*)decoded,decodeLen,unpressed);
-      } else if(m_bNumpressPic){
-        if(m_bZlib) ms::numpress::MSNumpress::decodePic((unsigned char*)unzipped,(const size_t)unzippedLen,unpressed);
-        else ms::numpress::MSNumpress::decodePic((unsigned char*)decoded,decodeLen,unpressed);
-      }
-	} catch (const char* ch){
-	  cout << "Exception: " << ch << endl;
-	  exit(EXIT_FAILURE);
-	}
-
-    if(m_bZlib) delete [] unzipped;
-    else delete [] decoded;
-    for(i=0;i<m_peaksCount;i++) d.push_back(unpressed[i]);
-    delete [] unpressed;
-    return;
-  }
-
-  //Byte order correction
-  if(m_bZlib){
-    if(m_iDataType==1){
-      uint32_t* unzipped32 = (uint32_t*)unzipped;
-      for(i=0;i<m_peaksCount;i++){
-		    uData32.i = dtohl(unzipped32[i], m_bNetworkData);
-		    d.push_back(uData32.d);
-	    }
-    } else if(m_iDataType==2) {
-      uint64_t* unzipped64 = (uint64_t*)unzipped;
-      for(i=0;i<m_peaksCount;i++){
-		    uData64.i = dtohl(unzipped64[i], m_bNetworkData);
-		    d.push_back(uData64.d);
-	    }
-    }
-    delete [] unzipped;
-  } else {
-    if(m_iDataType==1){
-      uint32_t* decoded32 = (uint32_t*)decoded;
-      for(i=0;i<m_peaksCount;i++){
-		    uData32.i = dtohl(decoded32[i], m_bNetworkData);
-		    d.push_back(uData32.d);
-	    }
-    } else if(m_iDataType==2) {
-      uint64_t* decoded64 = (uint64_t*)decoded;
-      for(i=0;i<m_peaksCount;i++){
-		    uData64.i = dtohl(decoded64[i], m_bNetworkData);
-		    d.push_back(uData64.d);
-	    }
-    }
-    delete [] decoded;
-  }
-
-}
-
-unsigned long mzpSAXMzmlHandler::dtohl(uint32_t l, bool bNet) {
-
-#ifdef OSX
-	if (!bNet)
-	{
-		l = (l << 24) | ((l << 8) & 0xFF0000) |
-			(l >> 24) | ((l >> 8) & 0x00FF00);
-	}
-#else
-	if (bNet)
-	{
-		l = (l << 24) | ((l << 8) & 0xFF0000) |
-			(l >> 24) | ((l >> 8) & 0x00FF00);
-	}
-#endif
-	return l;
-}
-
-uint64_t mzpSAXMzmlHandler::dtohl(uint64_t l, bool bNet) {
-
-#ifdef OSX
-	if (!bNet)
-	{
-		l = (l << 56) | ((l << 40) & 0xFF000000000000LL) | ((l << 24) & 0x0000FF0000000000LL) | ((l << 8) & 0x000000FF00000000LL) |
-			(l >> 56) | ((l >> 40) & 0x0000000000FF00LL) | ((l >> 24) & 0x0000000000FF0000LL) | ((l >> 8) & 0x00000000FF000000LL) ;
-	}
-#else
-	if (bNet)
-	{
-		l = (l << 56) | ((l << 40) & 0x00FF000000000000LL) | ((l << 24) & 0x0000FF0000000000LL) | ((l << 8) & 0x000000FF00000000LL) |
-			(l >> 56) | ((l >> 40) & 0x000000000000FF00LL) | ((l >> 24) & 0x0000000000FF0000LL) | ((l >> 8) & 0x00000000FF000000LL) ;
-	}
-#endif
-	return l;
+#define MZP_INDEX_BLOCK 4194304		//bytes searched per read while indexing
+#define MZP_INDEX_OVERLAP 65536		//look-ahead for start tags that straddle a block
+#define MZP_INDEX_MINRANGE 33554432	//smallest file range given to an indexing thread
+
+//Searches [start,stop) of the uncompressed file for <spectrum and <chromatogram start
+//tags and records their offsets and id attributes. Plain and MZGF files are opened
+//anew so that several ranges can be searched at once; gz files indexed by Czran
+//share this handler's reader, and must be searched by a single range.
+void mzpSAXMzmlHandler::indexRange(f_off start, f_off stop, mzpIndex* vSpec, mzpIndex* vChromat){
+
+	FILE* f=NULL;
+	MZGFile::MZGFileReader* z=NULL;
+	if(mzgf){
+		z = new MZGFile::MZGFileReader();
+		if(z->open(&m_strFileName[0])!=0){
+			z->close();
+			delete z;
+			return;
+		}
+		z->useek(start);
+	} else if(m_bGZCompression){
+		seekFile(start);
+	} else {
+		f=fopen(&m_strFileName[0],"rb");
+		if(f==NULL) return;
+		mzpfseek(f,start,SEEK_SET);
+	}
+
+	char* buf = new char[MZP_INDEX_BLOCK+MZP_INDEX_OVERLAP+1];
+	f_off bufStart=start;
+	int have=0;
+	int n;
+	cindex ci;
+	ci.scanNum=0;
+
+	while(bufStart<stop){
+
+		//fill the buffer, keeping the look-ahead from the previous block
+		while(have<MZP_INDEX_BLOCK+MZP_INDEX_OVERLAP){
+			if(z) n=(int)z->read((unsigned char*)buf+have, MZP_INDEX_BLOCK+MZP_INDEX_OVERLAP-have);
+			else if(f) n=(int)fread(buf+have, 1, MZP_INDEX_BLOCK+MZP_INDEX_OVERLAP-have, f);
+			else n=readFile(buf+have, MZP_INDEX_BLOCK+MZP_INDEX_OVERLAP-have);
+			if(n<=0) break;
+			have+=n;
+		}
+		if(have==0) break;
+		buf[have]='\0';
+
+		//tags must start within this block and within the range
+		int blockEnd=MZP_INDEX_BLOCK;
+		if(blockEnd>have) blockEnd=have;
+		if(stop-bufStart<blockEnd) blockEnd=(int)(stop-bufStart);
+
+		char* p=buf;
+		char* end=buf+blockEnd;
+		while(p<end && (p=(char*)memchr(p,'<',end-p))!=NULL){
+			mzpIndex* v=NULL;
+			char* c;
+			if(!strncmp(p+1,"spectrum",8)) { v=vSpec; c=p+9; }
+			else if(!strncmp(p+1,"chromatogram",12)) { v=vChromat; c=p+13; }
+			if(v==NULL || (*c!=' ' && *c!='\t' && *c!='\r' && *c!='\n')) {
+				p++;
+				continue;
+			}
+
+			//the id attribute; left empty if the tag is not entirely in the buffer
+			ci.offset=bufStart+(p-buf);
+			ci.idRef.clear();
+			char* gt=(char*)memchr(c,'>',buf+have-c);
+			if(gt!=NULL){
+				*gt='\0';
+				char* id=c;
+				while((id=strstr(id,"id="))!=NULL){
+					if((id[-1]==' ' || id[-1]=='\t' || id[-1]=='\r' || id[-1]=='\n') && (id[3]=='"' || id[3]=='\'')){
+						char* q=strchr(id+4,id[3]);
+						if(q!=NULL) ci.idRef.assign(id+4,q-id-4);
+						break;
+					}
+					id+=3;
+				}
+				*gt='>';
+			}
+			v->push_back(ci);
+			p=c;
+		}
+
+		//carry the look-ahead into the next block
+		bufStart+=blockEnd;
+		have-=blockEnd;
+		if(have>0) memmove(buf,buf+blockEnd,have);
+	}
+
+	delete [] buf;
+	if(f) fclose(f);
+	if(z) {
+		z->close();
+		delete z;
+	}
+}
+
+//Builds m_vIndex and m_vChromatIndex for mzML files that lack an <indexList> by
+//searching the raw text for start tags; no XML is parsed. Large plain and MZGF
+//files are split into ranges that are searched in parallel.
+bool mzpSAXMzmlHandler::buildIndex(){
+
+	f_off fileSize;
+	if(mzgf) fileSize=mzgf->ufilesize();
+	else if(m_bGZCompression) fileSize=gzObj.getfilesize();
+	else {
+		mzpfseek(fptr,0,SEEK_END);
+		fileSize=mzpftell(fptr);
+	}
+	if(fileSize<=0) return false;
+
+	int nThreads=1;
+	if(!m_bGZCompression || mzgf){
+		nThreads=(int)thread::hardware_concurrency();
+		if(nThreads<1) nThreads=1;
+		if(fileSize/MZP_INDEX_MINRANGE+1<nThreads) nThreads=(int)(fileSize/MZP_INDEX_MINRANGE+1);
+	}
+
+	vector<mzpIndex> vSpec(nThreads);
+	vector<mzpIndex> vChromat(nThreads);
+	if(nThreads==1){
+		indexRange(0,fileSize,&vSpec[0],&vChromat[0]);
+	} else {
+		vector<thread> threads;
+		f_off rangeSize=fileSize/nThreads+1;
+		for(int i=0;i<nThreads;i++){
+			f_off start=rangeSize*i;
+			f_off stop=start+rangeSize;
+			if(stop>fileSize) stop=fileSize;
+			threads.push_back(thread(&mzpSAXMzmlHandler::indexRange,this,start,stop,&vSpec[i],&vChromat[i]));
+		}
+		for(int i=0;i<nThreads;i++) threads[i].join();
+	}
+
+	//gather the ranges in file order, recovering ids of tags that straddled the look-ahead
+	char tag[CHUNK+1];
+	cindex ci;
+	m_vIndex.clear();
+	m_vChromatIndex.clear();
+	m_scanIDXCount=0;
+	for(int i=0;i<nThreads;i++){
+		for(size_t j=0;j<vSpec[i].size();j++){
+			ci.offset=vSpec[i].offset[j];
+			ci.idRef=vSpec[i][j].idRef;
+			if(ci.idRef.empty()){
+				seekFile(ci.offset);
+				int n=readFile(tag,CHUNK);
+				tag[n]='\0';
+				char* id=strstr(tag," id=\"");
+				char* gt=strchr(tag,'>');
+				if(id!=NULL && (gt==NULL || id<gt)) {
+					char* q=strchr(id+5,'"');
+					if(q!=NULL) ci.idRef.assign(id+5,q-id-5);
+				}
+			}
+			if(strstr(&ci.idRef[0],"scan=")!=NULL)	{
+				ci.scanNum=atoi(strstr(&ci.idRef[0],"scan=")+5);
+			} else if(strstr(&ci.idRef[0],"scanId=")!=NULL) {
+				ci.scanNum=atoi(strstr(&ci.idRef[0],"scanId=")+7);
+			} else if(strstr(&ci.idRef[0],"S")!=NULL) {
+				ci.scanNum=atoi(strstr(&ci.idRef[0],"S")+1);
+			} else {
+				ci.scanNum=++m_scanIDXCount;
+			}
+			m_vIndex.push_back(ci);
+		}
+		for(size_t j=0;j<vChromat[i].size();j++) m_vChromatIndex.push_back(vChromat[i][j]);
+	}
+
+	return m_vIndex.size()>0 || m_vChromatIndex.size()>0;
 }
 
 //Finding the index list offset is done without the xml parser
@@ -732,8 +1158,8 @@ uint64_t mzpSAXMzmlHandler::dtohl(uint64_t l, bool bNet) {
 //tag is placed anywhere other than the end of the mzML file.
 f_off mzpSAXMzmlHandler::readIndexOffset() {
 
-	char buffer[200];
-	char chunk[CHUNK];
+	char buffer[201];
+	char chunk[CHUNK+1];
 	char* start;
 	char* stop;
 	int readBytes;
@@ -744,23 +1170,23 @@ f_off mzpSAXMzmlHandler::readIndexOffset() {
 		mzpfseek(f,-200,SEEK_END);
 		sz = fread(buffer,1,200,f);
 		fclose(f);
+		buffer[sz]='\0';
 		start=strstr(buffer,"<indexListOffset>");
 		stop=strstr(buffer,"</indexListOffset>");
 	} else if ( mzgf ) {
-		mzgf->useek( mzgf->filesize()-200 );
-		readBytes = mzgf->read((unsigned char*)chunk, CHUNK);
+		mzgf->useek( mzgf->ufilesize()-200 );
+		readBytes = (int)mzgf->read((unsigned char*)chunk, CHUNK);
+		chunk[readBytes>0 ? readBytes : 0]='\0';
 		start=strstr(chunk,"<indexListOffset>");
 		stop=strstr(chunk,"</indexListOffset>");
 	} else {
 		readBytes = gzObj.extract(fptr, gzObj.getfilesize()-200, (unsigned char*)chunk, CHUNK);
+		chunk[readBytes>0 ? readBytes : 0]='\0';
 		start=strstr(chunk,"<indexListOffset>");
 		stop=strstr(chunk,"</indexListOffset>");
 	}
 
-	if(start==NULL || stop==NULL) {
-		cerr << "No index list offset found. File will not be read." << endl;
-		return 0;
-	}
+	if(start==NULL || stop==NULL) return 0;
 
 	char offset[64];
 	int len=(int)(stop-start-17);
@@ -770,28 +1196,813 @@ f_off mzpSAXMzmlHandler::readIndexOffset() {
 
 }
 
+//Locates the next occurrence of tag in [p,end). memchr does the bulk of the
+//work, and is vectorized by the C runtime on the platforms we build for.
+static const char* mzpFindTag(const char* p, const char* end, const char* tag, size_t len){
+	while(p+len<=end){
+		p=(const char*)memchr(p,'<',end-p);
+		if(p==NULL || p+len>end) return NULL;
+		if(memcmp(p,tag,len)==0) return p;
+		p++;
+	}
+	return NULL;
+}
+
+//Replaces the predefined XML entities in a NUL-terminated attribute value.
+//Returns false on anything else (e.g. character references).
+static bool mzpUnescape(char* s){
+	char* d=s;
+	while(*s){
+		if(*s!='&'){
+			*d++=*s++;
+			continue;
+		}
+		if(!strncmp(s,"&lt;",4)) { *d++='<'; s+=4; }
+		else if(!strncmp(s,"&gt;",4)) { *d++='>'; s+=4; }
+		else if(!strncmp(s,"&amp;",5)) { *d++='&'; s+=5; }
+		else if(!strncmp(s,"&quot;",6)) { *d++='"'; s+=6; }
+		else if(!strncmp(s,"&apos;",6)) { *d++='\''; s+=6; }
+		else return false;
+	}
+	*d='\0';
+	return true;
+}
+
+#define MZP_SCAN_ATTR 32
+#define MZP_SCAN_STOP 0			// the handler stopped the parse
+#define MZP_SCAN_MORE 1			// the buffer ended inside a tag or binary text
+#define MZP_SCAN_FAIL 2			// markup the scanner does not handle
+#define MZP_STREAM_BUF 1048576
+#define MZP_STREAM_PEEK 256
+
+static inline bool mzpIsSpace(char c){
+	return c==' ' || c=='\t' || c=='\r' || c=='\n';
+}
+
+//Orders index positions by file offset
+struct mzpOffsetOrder {
+	const mzpIndex* v;
+	bool operator()(int a, int b) const { return v->offset[a]<v->offset[b]; }
+};
+
+//Tokenizes the tags in [*pp,end) in place and replays them through startElement()
+//and endElement() until the handler stops the parse. Character data is delivered only
+//for <binary>. A tag, or binary text, that is cut off by the end of the buffer is left
+//untouched, with *pp pointing at it, so the caller can read more and call again.
+int mzpSAXMzmlHandler::scanTags(char** pp, char* end){
+	const XML_Char* attr[MZP_SCAN_ATTR*2+1];
+	char* aName[MZP_SCAN_ATTR];
+	char* aNameEnd[MZP_SCAN_ATTR];
+	char* aVal[MZP_SCAN_ATTR];
+	char* aValEnd[MZP_SCAN_ATTR];
+	char* p = *pp;
+
+	while(!m_bStopParse){
+		char* lt = (char*)memchr(p, '<', end-p);
+		if(lt==NULL) { *pp=end; return MZP_SCAN_MORE; }
+		*pp = lt;
+		p = lt+1;
+		if(p>=end) return MZP_SCAN_MORE;
+
+		if(*p=='/'){
+			char* gt = (char*)memchr(p, '>', end-p);
+			if(gt==NULL) return MZP_SCAN_MORE;
+			char* name = ++p;
+			while(p<gt && !mzpIsSpace(*p)) p++;
+			*p = '\0';
+			endElement(name);
+			p = gt+1;
+			continue;
+		}
+		if(*p=='!' || *p=='?') return MZP_SCAN_FAIL;
+
+		//start tag: find the name and attributes before changing anything
+		char* name = p;
+		while(p<end && *p!='>' && *p!='/' && !mzpIsSpace(*p)) p++;
+		char* nameEnd = p;
+		int nAttr = 0;
+		bool bEmpty = false;
+		for(;;){
+			while(p<end && mzpIsSpace(*p)) p++;
+			if(p>=end) return MZP_SCAN_MORE;
+			if(*p=='>') break;
+			if(*p=='/'){
+				if(p+1>=end) return MZP_SCAN_MORE;
+				if(p[1]!='>') return MZP_SCAN_FAIL;
+				bEmpty=true;
+				p++;
+				break;
+			}
+			if(nAttr==MZP_SCAN_ATTR) return MZP_SCAN_FAIL;
+			aName[nAttr] = p;
+			while(p<end && *p!='=' && *p!='>' && !mzpIsSpace(*p)) p++;
+			aNameEnd[nAttr] = p;
+			while(p<end && mzpIsSpace(*p)) p++;
+			if(p>=end) return MZP_SCAN_MORE;
+			if(*p!='=') return MZP_SCAN_FAIL;
+			p++;
+			while(p<end && mzpIsSpace(*p)) p++;
+			if(p>=end) return MZP_SCAN_MORE;
+			if(*p!='"' && *p!='\'') return MZP_SCAN_FAIL;
+			aVal[nAttr] = p+1;
+			p = (char*)memchr(p+1, *p, end-p-1);
+			if(p==NULL) return MZP_SCAN_MORE;
+			aValEnd[nAttr++] = p++;
+		}
+		char* gt = p;
+
+		//binary text has to be complete as well; encodedLength, when it lands on the
+		//closing tag, saves searching the text for it
+		char* text = NULL;
+		char* textEnd = NULL;
+		if(!bEmpty && nameEnd-name==6 && !memcmp(name,"binary",6)){
+			text = gt+1;
+			if(m_encodedLen>0 && end-text>m_encodedLen && text[m_encodedLen]=='<') textEnd = text+m_encodedLen;
+			else textEnd = (char*)memchr(text, '<', end-text);
+			if(textEnd==NULL) return MZP_SCAN_MORE;
+		}
+
+		//the tag is complete, so terminate and unescape in place
+		for(int i=0;i<nAttr;i++){
+			*aNameEnd[i] = '\0';
+			*aValEnd[i] = '\0';
+			if(memchr(aVal[i], '&', aValEnd[i]-aVal[i])!=NULL && !mzpUnescape(aVal[i])) return MZP_SCAN_FAIL;
+			attr[i*2] = aName[i];
+			attr[i*2+1] = aVal[i];
+		}
+		attr[nAttr*2] = NULL;
+		*nameEnd = '\0';
+		p = gt+1;
+
+		startElement(name, attr);
+		if(bEmpty) {
+			if(!m_bStopParse) endElement(name);
+		} else if(text!=NULL && !m_bStopParse) {
+			characters(text, (int)(textEnd-text));
+			p = textEnd;
+		}
+	}
+	*pp = p;
+	return MZP_SCAN_STOP;
+}
+
+//Undoes the partial results of a scan so the spectrum can be read again by expat.
+void mzpSAXMzmlHandler::cancelScan(int scanSPECCount, int scanPRECCount){
+	spec->clear();
+	m_scanSPECCount = scanSPECCount;
+	m_scanPRECCount = scanPRECCount;
+	m_bZlib=false;
+	m_bNumpressLinear=false;
+	m_bNumpressSlof=false;
+	m_bNumpressPic=false;
+	m_iDataType=0;
+	m_iExtraArray=0;
+	stopParser();
+}
+
+//Reads a single <spectrum> element and replays it through scanTags() without
+//going through expat. specLen, if known, sizes the first read. The structure of a
+//spectrum is fixed and simple; comments, processing instructions, CDATA, or
+//character references cause a return of false with the spectrum cleared, and
+//the caller should fall back to parseOffset().
+bool mzpSAXMzmlHandler::scanSpectrum(f_off offset, int specLen){
+
+	if(fptr==NULL && mzgf==NULL) return false;
+
+	//read the spectrum (or just its header) into the scan buffer
+	const char* stopTag = m_bHeaderOnly ? "<binaryDataArrayList" : "</spectrum>";
+	size_t stopLen = strlen(stopTag);
+	const char* stop = NULL;
+	int len = 0;
+	int readLen = specLen>0 ? specLen : CHUNK;
+	int readBytes;
+	seekFile(offset);
+	while(stop==NULL){
+		if(m_scanBufSize-len<readLen+1){
+			m_scanBufSize = (len+readLen+1)*2;
+			char* buf = new char[m_scanBufSize];
+			if(len>0) memcpy(buf,m_scanBuf,len);
+			delete [] m_scanBuf;
+			m_scanBuf = buf;
+		}
+		readBytes = readFile(m_scanBuf+len, readLen);
+		if(readBytes==0) return false;
+		readLen = CHUNK;
+		int from = len>(int)stopLen ? len-(int)stopLen : 0;
+		len += readBytes;
+		stop = mzpFindTag(m_scanBuf+from, m_scanBuf+len, stopTag, stopLen);
+		if(m_bHeaderOnly){
+			//a spectrum without binary data arrays ends before any binaryDataArrayList
+			const char* close = mzpFindTag(m_scanBuf+from, stop==NULL ? m_scanBuf+len : stop, "</spectrum>", 11);
+			if(close!=NULL) stop = close;
+		}
+	}
+
+	//terminate after the closing '>' of the stop tag
+	char* end = (char*)memchr(stop, '>', m_scanBuf+len-stop);
+	if(end==NULL) return false;
+	end++;
+	*end = '\0';
+	return scanSpectrumText(m_scanBuf,end);
+}
+
+//Decodes the spectra at positions [first,last) of the parent's index into out. Runs
+//of spectra that follow one another in the file are read at once and scanned in
+//place, as in readSpectra(). The spectra take the storage precision of the parent's.
+void mzpSAXMzmlHandler::scanBlock(const mzpSAXMzmlHandler* parent, int first, int last, vector<BasicSpectrum>& out){
+	const mzpIndex& v=parent->m_vIndex;
+	int i,j,k;
+	int precision = parent->spec==NULL ? precDouble : parent->spec->getPrecision();
+	out.resize(last-first);
+	for(i=first;i<last;i=j){
+
+		//extend the run while the next spectrum starts where this one ends
+		f_off len=parent->spectrumSpan(i);
+		for(j=i+1;j<last && len>0;j++){
+			int span=parent->spectrumSpan(j);
+			if(v[j].offset!=v[i].offset+len || span==0 || len+span>MAXSPAN) break;
+			len+=span;
+		}
+
+		int got=0;
+		int readBytes;
+		if(len>0){
+			if(m_scanBufSize<len+1){
+				delete [] m_scanBuf;
+				m_scanBufSize=(int)len+1;
+				m_scanBuf=new char[m_scanBufSize];
+			}
+			seekFile(v[i].offset);
+			while(got<len && (readBytes=readFile(m_scanBuf+got,(int)len-got))>0) got+=readBytes;
+		}
+
+		for(k=i;k<j;k++){
+			spec=&out[k-first];
+			spec->clear();
+			spec->setPrecision(precision);
+			if(len==0){
+				if(!scanSpectrum(v[k].offset)) parseOffset(v[k].offset);
+			} else {
+				int span=parent->spectrumSpan(k);
+				f_off from=v[k].offset-v[i].offset;
+				char* p=m_scanBuf+from;
+				char* end=m_scanBuf+(from+span<got ? from+span : got);
+				if(p>=end || !scanSpectrumText(p,end)) parseOffset(v[k].offset,span);
+			}
+			if(spec->getScanNum()!=v[k].scanNum) spec->setScanNum(v[k].scanNum);
+			spec->setScanIndex(k+1);
+		}
+	}
+}
+
+//Scans a spectrum already in memory at [p,end), allowing leading whitespace. The
+//text is tokenized in place. Returns false, with the spectrum cleared, if it could not be scanned.
+bool mzpSAXMzmlHandler::scanSpectrumText(char* p, char* end){
+	while(p<end && mzpIsSpace(*p)) p++;
+	if(end-p<9 || strncmp(p,"<spectrum",9)!=0) return false;
+
+	int scanSPECCount = m_scanSPECCount;
+	int scanPRECCount = m_scanPRECCount;
+	m_bStopParse = false;
+	if(scanTags(&p,end)!=MZP_SCAN_STOP){
+		cancelScan(scanSPECCount,scanPRECCount);
+		return false;
+	}
+	return true;
+}
+
+//Moves the unread tail [p,end) of the scan buffer to its front and fills the rest
+//from the file, growing the buffer when the tail takes up half of it. bufOffset is
+//the file offset of m_scanBuf[0]. Returns false when nothing more could be read.
+bool mzpSAXMzmlHandler::fillScanBuf(char*& p, char*& end, f_off& bufOffset){
+	int keep = (int)(end-p);
+	bufOffset += p-m_scanBuf;
+	if(m_scanBufSize<MZP_STREAM_BUF+1 || keep*2>=m_scanBufSize){
+		int size = m_scanBufSize<MZP_STREAM_BUF+1 ? MZP_STREAM_BUF+1 : m_scanBufSize*2;
+		char* buf = new char[size];
+		if(keep>0) memcpy(buf,p,keep);
+		delete [] m_scanBuf;
+		m_scanBuf = buf;
+		m_scanBufSize = size;
+	} else if(keep>0) {
+		memmove(m_scanBuf,p,keep);
+	}
+	int readBytes = readFile(m_scanBuf+keep, m_scanBufSize-keep-1);
+	p = m_scanBuf;
+	end = m_scanBuf+keep+readBytes;
+	*end = '\0';
+	return readBytes>0;
+}
+
+//Reads the spectrumList in one sequential pass, starting with the spectrum at start,
+//and calls fn with the file offset of each spectrum once the handler has stopped on
+//it. With m_bHeaderOnly, the handler stops at the binaryDataArrayList, and the binary
+//data that follows is jumped over using encodedLength, seeking past whatever has not
+//been read yet. The pass ends at </spectrumList>, or when fn returns false. Returns
+//false if a spectrum could not be scanned; the caller must read the rest another way.
+bool mzpSAXMzmlHandler::streamSpectra(f_off start, bool (mzpSAXMzmlHandler::*fn)(f_off)){
+
+	if(fptr==NULL && mzgf==NULL) return false;
+
+	char* p = m_scanBuf;
+	char* end = m_scanBuf;
+	f_off bufOffset = start;
+	f_off specOffset = 0;
+	long skipLen = 0;
+	bool bInSpec = false;
+	bool bEOF = false;
+	int scanSPECCount = 0;
+	int scanPRECCount = 0;
+
+	seekFile(start);
+	if(!fillScanBuf(p,end,bufOffset)) return false;
+
+	for(;;){
+		if(bInSpec){
+			int r = scanTags(&p,end);
+			if(r==MZP_SCAN_MORE){
+				if(!bEOF && fillScanBuf(p,end,bufOffset)) continue;
+				r = MZP_SCAN_FAIL;
+			}
+			if(r==MZP_SCAN_FAIL){
+				cancelScan(scanSPECCount,scanPRECCount);
+				return false;
+			}
+			bInSpec = false;
+			if(!(this->*fn)(specOffset)) return true;
+			continue;
+		}
+
+		//between spectra, only look for the next one, and for binary data to jump over
+		char* lt = (char*)memchr(p, '<', end-p);
+		if(lt==NULL || (end-lt<MZP_STREAM_PEEK && !bEOF)){
+			if(bEOF) return true;
+			p = lt==NULL ? end : lt;
+			if(!fillScanBuf(p,end,bufOffset)) bEOF = true;
+			continue;
+		}
+		p = lt+1;
+		if(!strncmp(p,"spectrum",8) && mzpIsSpace(p[8])){
+			specOffset = bufOffset+(lt-m_scanBuf);
+			p = lt;
+			spec->clear();
+			scanSPECCount = m_scanSPECCount;
+			scanPRECCount = m_scanPRECCount;
+			m_bStopParse = false;
+			bInSpec = true;
+		} else if(!strncmp(p,"/spectrumList",13)){
+			return true;
+		} else if(!strncmp(p,"binaryDataArray",15) && mzpIsSpace(p[15])){
+			char* gt = (char*)memchr(p, '>', end-p);
+			skipLen = 0;
+			if(gt!=NULL){
+				*gt = '\0';
+				char* q = strstr(p, "encodedLength=");
+				if(q!=NULL) skipLen = atol(q+15);
+				*gt = '>';
+			}
+		} else if(!strncmp(p,"binary>",7)){
+			p += 7;
+			if(skipLen>0){
+				if(end-p>skipLen) {
+					p += skipLen;
+				} else {
+					f_off target = bufOffset+(p-m_scanBuf)+skipLen;
+					seekFile(target);
+					bufOffset = target;
+					p = end = m_scanBuf;
+					if(!fillScanBuf(p,end,bufOffset)) return false;
+				}
+				skipLen = 0;
+				if(end-p<MZP_STREAM_PEEK && !bEOF && !fillScanBuf(p,end,bufOffset)) bEOF = true;
+
+				//the jump must land on </binary>, or encodedLength cannot be trusted
+				while(p<end && mzpIsSpace(*p)) p++;
+				if(strncmp(p,"</binary>",9)) return false;
+			}
+		}
+	}
+}
+
+//Records the header just streamed from offset in m_headerTable. Spectra are met in
+//file order, so the index positions sorted by offset are walked alongside.
+bool mzpSAXMzmlHandler::addHeaderRow(f_off offset){
+	if(m_iStreamRow>=(int)m_vOffsetOrder.size()) return false;
+	int pos=m_vOffsetOrder[m_iStreamRow];
+	if(offset<m_vIndex[pos].offset) return true; //not in the index
+	if(m_iStreamRow+1<(int)m_vOffsetOrder.size() && offset>=m_vIndex[m_vOffsetOrder[m_iStreamRow+1]].offset) return false;
+	if(spec->getScanNum()!=m_vIndex[pos].scanNum) spec->setScanNum(m_vIndex[pos].scanNum);
+	m_headerTable.setRow(pos,*spec,m_vIndex[pos].offset);
+	m_iStreamRow++;
+	return true;
+}
+
+//Passes the spectrum just streamed from offset to the m_streamFn callback. Spectra are
+//met in file order, so the index positions sorted by offset are walked alongside.
+bool mzpSAXMzmlHandler::streamRow(f_off offset){
+	if(m_iStreamRow>=(int)m_vOffsetOrder.size()) return false;
+	int pos=m_vOffsetOrder[m_iStreamRow];
+	if(offset<m_vIndex[pos].offset) return true; //not in the index
+	if(m_iStreamRow+1<(int)m_vOffsetOrder.size() && offset>=m_vIndex[m_vOffsetOrder[m_iStreamRow+1]].offset) return false;
+	if(spec->getScanNum()!=m_vIndex[pos].scanNum) spec->setScanNum(m_vIndex[pos].scanNum);
+	spec->setScanIndex(pos+1);
+	m_iStreamRow++;
+	if(!m_streamFn(*spec,m_streamData)) {
+		m_streamFn=NULL;
+		return false;
+	}
+	return true;
+}
+
+//Passes every spectrum to fn, with data, in file order, from one sequential read of
+//the spectrumList: there is no seek or parser reset between spectra, and the handler's
+//spectrum and buffers are reused for each. A spectrum the pass cannot scan is read by
+//expat, and the pass resumes after it. Returns false if the file has no index.
+bool mzpSAXMzmlHandler::streamAll(mzpSpectrumCallback fn, void* data){
+	if(m_bNoIndex) return false;
+
+	int n=(int)m_vIndex.size();
+	sortOffsetOrder();
+	m_streamFn=fn;
+	m_streamData=data;
+	m_iStreamRow=0;
+	while(m_iStreamRow<n && m_streamFn!=NULL){
+		streamSpectra(m_vIndex[m_vOffsetOrder[m_iStreamRow]].offset,&mzpSAXMzmlHandler::streamRow);
+		if(m_iStreamRow>=n || m_streamFn==NULL) break;
+
+		//read the spectrum the pass stopped at on its own, then carry on
+		int pos=m_vOffsetOrder[m_iStreamRow++];
+		spec->clear();
+		if(!scanSpectrum(m_vIndex[pos].offset,spectrumSpan(pos))) parseOffset(m_vIndex[pos].offset,spectrumSpan(pos));
+		if(spec->getScanNum()!=m_vIndex[pos].scanNum) spec->setScanNum(m_vIndex[pos].scanNum);
+		spec->setScanIndex(pos+1);
+		if(!fn(*spec,data)) break;
+	}
+	m_streamFn=NULL;
+	m_streamData=NULL;
+	return true;
+}
+
+//Fills m_vOffsetOrder with the index positions in file order.
+void mzpSAXMzmlHandler::sortOffsetOrder(){
+	int n=(int)m_vIndex.size();
+	m_vOffsetOrder.resize(n);
+	for(int i=0;i<n;i++) m_vOffsetOrder[i]=i;
+	mzpOffsetOrder cmp;
+	cmp.v=&m_vIndex;
+	stable_sort(m_vOffsetOrder.begin(),m_vOffsetOrder.end(),cmp);
+}
+
+//Reads the header of every spectrum in one sequential pass over the spectrumList into
+//m_headerTable, after which readHeader() is answered from memory. A spectrum the pass
+//cannot scan is read by expat, and the pass resumes after it.
+bool mzpSAXMzmlHandler::scanHeaders(){
+	m_headerTable.clear();
+	if(m_bNoIndex || m_vIndex.size()==0) return false;
+
+	int n=(int)m_vIndex.size();
+	sortOffsetOrder();
+
+	m_headerTable.resize(n);
+	m_iStreamRow=0;
+	m_bHeaderOnly=true;
+	while(m_iStreamRow<n){
+		streamSpectra(m_vIndex[m_vOffsetOrder[m_iStreamRow]].offset,&mzpSAXMzmlHandler::addHeaderRow);
+		if(m_iStreamRow>=n) break;
+
+		//read the spectrum the pass stopped at on its own, then carry on
+		int pos=m_vOffsetOrder[m_iStreamRow++];
+		spec->clear();
+		parseOffset(m_vIndex[pos].offset,spectrumSpan(pos,true));
+		if(spec->getScanNum()!=m_vIndex[pos].scanNum) spec->setScanNum(m_vIndex[pos].scanNum);
+		m_headerTable.setRow(pos,*spec,m_vIndex[pos].offset);
+	}
+	m_bHeaderOnly=false;
+	spec->clear();
+	return true;
+}
+
 bool mzpSAXMzmlHandler::load(const char* fileName){
+	clearWorkers();
 	if(!open(fileName)) return false;
 	m_vInstrument.clear();
 	m_vIndex.clear();
+	m_mIdRefPos.clear();	//its keys point into m_vIndex
 	m_vChromatIndex.clear();
+	m_headerTable.clear();
 	parseOffset(0);
+	posIndex=-1;
+	posChromatIndex=-1;
+	m_bNoIndex=false;
+
+	//a valid index cache spares parsing, or building, the index
+	if(readIndexCache(m_vIndex,m_vChromatIndex,indexOffset)) {
+		buildLookup();
+		return true;
+	}
+
 	indexOffset = readIndexOffset();
 	if(indexOffset==0){
-		m_bNoIndex=true;
-		return false;
+		//no index list, so index the spectra directly
+		if(!buildIndex()){
+			m_bNoIndex=true;
+			cerr << "Cannot build index. File will not be read." << endl;
+			return false;
+		}
 	} else {
-		m_bNoIndex=false;
 		if(!parseOffset(indexOffset)){
 			cerr << "Cannot parse index. Make sure index offset is correct or rebuild index." << endl;
 			return false;
 		}
-		posIndex=-1;
-		posChromatIndex=-1;
 	}
+	writeIndexCache(m_vIndex,m_vChromatIndex,indexOffset);
+	buildLookup();
 	return true;
 }
 
+//Builds the scan number and nativeID lookup tables over m_vIndex. Scan numbers
+//are not assumed to be sorted or unique; the first spectrum with a number wins.
+//A dense table is used unless scan numbers are spread far wider than the index.
+void mzpSAXMzmlHandler::buildLookup(){
+	m_vScanPos.clear();
+	m_mScanPos.clear();
+	m_mIdRefPos.clear();
+	m_iLowScan=0;
+	m_iHighScan=0;
+	if(m_vIndex.size()==0) return;
+
+	size_t i;
+	m_iLowScan=m_vIndex[0].scanNum;
+	m_iHighScan=m_vIndex[0].scanNum;
+	for(i=1;i<m_vIndex.size();i++){
+		if(m_vIndex[i].scanNum<m_iLowScan) m_iLowScan=m_vIndex[i].scanNum;
+		if(m_vIndex[i].scanNum>m_iHighScan) m_iHighScan=m_vIndex[i].scanNum;
+	}
+
+	if((double)m_iHighScan-m_iLowScan < 4.0*m_vIndex.size()+1024){
+		m_vScanPos.assign(m_iHighScan-m_iLowScan+1,-1);
+		for(i=0;i<m_vIndex.size();i++){
+			int& pos=m_vScanPos[m_vIndex[i].scanNum-m_iLowScan];
+			if(pos<0) pos=(int)i;
+		}
+	} else {
+		m_mScanPos.reserve(m_vIndex.size());
+		for(i=0;i<m_vIndex.size();i++) m_mScanPos.insert(make_pair(m_vIndex[i].scanNum,(int)i));
+	}
+
+	m_mIdRefPos.reserve(m_vIndex.size());
+	for(i=0;i<m_vIndex.size();i++) m_mIdRefPos.insert(make_pair(m_vIndex[i].idRef,(int)i));
+}
+
+
+//Length of the spectrum at index position pos, for sizing its read. The last
+//spectrum ends where the chromatograms, or the index list, begin. Reads of
+//just the header need no more than one CHUNK.
+int mzpSAXMzmlHandler::spectrumSpan(int pos, bool header) const {
+	f_off end=indexOffset;
+	if(m_vChromatIndex.size()>0 && m_vIndex.size()>0 && m_vChromatIndex[0].offset>m_vIndex.back().offset) end=m_vChromatIndex[0].offset;
+	int len=indexSpan(m_vIndex,pos,end);
+	if(header && len>CHUNK) len=CHUNK;
+	return len;
+}
+
+//Length of the chromatogram at index position pos; see spectrumSpan().
+int mzpSAXMzmlHandler::chromatogramSpan(int pos) const {
+	f_off end=indexOffset;
+	if(m_vIndex.size()>0 && m_vChromatIndex.size()>0 && m_vIndex[0].offset>m_vChromatIndex.back().offset) end=m_vIndex[0].offset;
+	return indexSpan(m_vChromatIndex,pos,end);
+}
+
+void mzpSAXMzmlHandler::clearWorkers(){
+	for(size_t i=0;i<m_vWorkers.size();i++) delete m_vWorkers[i];
+	m_vWorkers.clear();
+}
+
+//Decodes every spectrum in the index on a pool of worker handlers, and passes each
+//one to fn, with data, in index order. The index is split into blocks of consecutive
+//spectra that the workers claim in turn; at most two blocks per worker are decoded
+//ahead of fn, which runs on the calling thread. threads<1 means one per core.
+//Returns false if the file has no index.
+bool mzpSAXMzmlHandler::decodeAll(mzpSpectrumCallback fn, void* data, int threads){
+	if(m_bNoIndex) return false;
+	int blocks=((int)m_vIndex.size()+MZP_QUEUE_BLOCK-1)/MZP_QUEUE_BLOCK;
+	if(blocks==0) return true;
+
+	if(threads<1) threads=(int)thread::hardware_concurrency();
+	if(threads<1) threads=1;
+	if(threads>blocks) threads=blocks;
+	threads=startWorkers(threads);
+	if(threads==0) return false;
+
+	int b,t;
+	size_t i;
+	mzpSpectrumQueue q;
+	q.slot.resize(threads*2);
+	q.block.assign(threads*2,-1);
+	q.done=0;
+	q.next=0;
+	q.cancel=false;
+	vector<thread> vThreads;
+	for(t=0;t<threads;t++) vThreads.push_back(thread(&mzpSAXMzmlHandler::decodeAllShare,m_vWorkers[t],this,&q));
+
+	bool go=true;
+	for(b=0;b<blocks && go;b++){
+		int k=b%(int)q.slot.size();
+		unique_lock<mutex> lk(q.lock);
+		while(q.block[k]!=b) q.cv.wait(lk);
+		lk.unlock();
+		for(i=0;i<q.slot[k].size() && go;i++) go=fn(q.slot[k][i],data);
+		lk.lock();
+		q.block[k]=-1;
+		q.done=b+1;
+		if(!go) q.cancel=true;
+		lk.unlock();
+		q.cv.notify_all();
+	}
+	for(i=0;i<vThreads.size();i++) vThreads[i].join();
+	return true;
+}
+
+//Decodes the spectra at the given index positions into specs, which is resized to
+//match, spreading them over a pool of worker handlers that each have the file open
+//on their own. threads<1 means one per core; the calling thread is one of them.
+//Returns false if any position was not in the index.
+bool mzpSAXMzmlHandler::decodeSpectra(const vector<int>& pos, vector<BasicSpectrum>& specs, int threads){
+	if(m_bNoIndex) return false;
+	specs.resize(pos.size());
+	if(pos.size()==0) return true;
+
+	if(threads<1) threads=(int)thread::hardware_concurrency();
+	if(threads<1) threads=1;
+	if(threads>(int)pos.size()) threads=(int)pos.size();
+
+	//spectra are claimed in file order, so each worker reads mostly forward
+	size_t i;
+	vector<pair<f_off,int> > vOff(pos.size());
+	for(i=0;i<pos.size();i++){
+		if(pos[i]>=0 && pos[i]<(int)m_vIndex.size()) vOff[i]=make_pair(m_vIndex[pos[i]].offset,(int)i);
+		else vOff[i]=make_pair((f_off)-1,(int)i);
+	}
+	sort(vOff.begin(),vOff.end());
+	vector<int> order(pos.size());
+	for(i=0;i<pos.size();i++) order[i]=vOff[i].second;
+
+	threads=startWorkers(threads);
+	if(threads==0) return false;
+
+	atomic<int> next(0);
+	atomic<bool> ok(true);
+	vector<thread> vThreads;
+	for(int t=1;t<threads;t++) vThreads.push_back(thread(&mzpSAXMzmlHandler::decodeShare,m_vWorkers[t],this,&pos,&order,&specs,&next,&ok));
+	m_vWorkers[0]->decodeShare(this,&pos,&order,&specs,&next,&ok);
+	for(i=0;i<vThreads.size();i++) vThreads[i].join();
+	return ok;
+}
+
+//Makes sure the pool has a worker handler for each of the threads, and returns how
+//many threads can be used. The pool is kept, and only grows, until the next load().
+int mzpSAXMzmlHandler::startWorkers(int threads){
+	while((int)m_vWorkers.size()<threads){
+		mzpSAXMzmlHandler* w=new mzpSAXMzmlHandler((BasicSpectrum*)NULL);
+		if(!w->openShared(*this)){
+			delete w;
+			break;
+		}
+		w->m_refGroupCvParams=m_refGroupCvParams;
+		w->m_bLazyDecode=false;
+		m_vWorkers.push_back(w);
+	}
+	for(size_t i=0;i<m_vWorkers.size();i++) {
+		m_vWorkers[i]->m_bCentroid=m_bCentroid;
+		m_vWorkers[i]->m_iArrays=m_iArrays;
+		m_vWorkers[i]->m_topPeaks.topN=m_topPeaks.topN;
+		m_vWorkers[i]->m_topPeaks.window=m_topPeaks.window;
+	}
+	if(threads>(int)m_vWorkers.size()) threads=(int)m_vWorkers.size();
+	return threads;
+}
+
+//Builds an extracted ion chromatogram for each m/z in mz, in the same order, from
+//all MS1 spectra. Each point is the intensity summed within ppm of the target.
+//Spectra are read once, in blocks spread over the worker pool as in decodeSpectra().
+bool mzpSAXMzmlHandler::extractXIC(const vector<double>& mz, double ppm, vector<BasicChromatogram>& xics, int threads){
+	if(m_bNoIndex) return false;
+	if(m_headerTable.size()==0 && !scanHeaders()) return false;
+
+	size_t i;
+	vector<int> pos;
+	vector<float> rTimes;
+	for(i=0;i<m_vIndex.size();i++){
+		if(m_headerTable.msLevel[i]!=1) continue;
+		pos.push_back((int)i);
+		rTimes.push_back(m_headerTable.rTime[i]);
+	}
+	mzpXIC xic(mz,ppm,xics,rTimes);
+	if(pos.size()==0 || mz.size()==0) return true;
+
+	if(threads<1) threads=(int)thread::hardware_concurrency();
+	if(threads<1) threads=1;
+	threads=startWorkers(threads);
+	if(threads==0) return false;
+
+	//chromatograms need both peak arrays, and sum every raw peak whatever
+	//setTopPeaks() or setCentroiding() would keep
+	for(i=0;i<m_vWorkers.size();i++) {
+		m_vWorkers[i]->m_iArrays=m_iArrays|arrayMZ|arrayIntensity;
+		m_vWorkers[i]->m_topPeaks.topN=0;
+		m_vWorkers[i]->m_bCentroid=false;
+	}
+
+	atomic<int> next(0);
+	vector<thread> vThreads;
+	for(int t=1;t<threads;t++) vThreads.push_back(thread(&mzpSAXMzmlHandler::xicShare,m_vWorkers[t],this,&pos,&xic,&next));
+	m_vWorkers[0]->xicShare(this,&pos,&xic,&next);
+	for(i=0;i<vThreads.size();i++) vThreads[i].join();
+	return true;
+}
+
+//Worker side of extractXIC(): claims blocks of consecutive MS1 spectra, so reads
+//stay mostly forward, and adds each one to the chromatograms.
+void mzpSAXMzmlHandler::xicShare(const mzpSAXMzmlHandler* parent, const vector<int>* pos, mzpXIC* xic, atomic<int>* next){
+	const mzpIndex& v=parent->m_vIndex;
+	const int block=16;
+	BasicSpectrum s;
+	spec=&s;
+	int i,k;
+	while((i=next->fetch_add(block))<(int)pos->size()){
+		for(k=i;k<i+block && k<(int)pos->size();k++){
+			int p=(*pos)[k];
+			s.clear();
+			if(!scanSpectrum(v[p].offset,parent->spectrumSpan(p))) parseOffset(v[p].offset,parent->spectrumSpan(p));
+			xic->addSpectrum(k,s);
+		}
+	}
+	spec=NULL;
+}
+
+//Worker side of decodeAll(): claims the next block, waits for its queue slot to be
+//free, and decodes the block into it.
+void mzpSAXMzmlHandler::decodeAllShare(const mzpSAXMzmlHandler* parent, mzpSpectrumQueue* q){
+	int n=(int)parent->m_vIndex.size();
+	int slots=(int)q->slot.size();
+	int b;
+	while((b=q->next++)<(n+MZP_QUEUE_BLOCK-1)/MZP_QUEUE_BLOCK){
+		unique_lock<mutex> lk(q->lock);
+		while(!q->cancel && b-q->done>=slots) q->cv.wait(lk);
+		if(q->cancel) break;
+		lk.unlock();
+		scanBlock(parent,b*MZP_QUEUE_BLOCK,min(b*MZP_QUEUE_BLOCK+MZP_QUEUE_BLOCK,n),q->slot[b%slots]);
+		lk.lock();
+		q->block[b%slots]=b;
+		lk.unlock();
+		q->cv.notify_all();
+	}
+	spec=NULL;
+}
+
+//Worker side of decodeSpectra(): claims the next spectrum until none are left, and
+//parses it, with the parent's index, straight into the caller's buffer.
+void mzpSAXMzmlHandler::decodeShare(const mzpSAXMzmlHandler* parent, const vector<int>* pos, const vector<int>* order, vector<BasicSpectrum>* specs, atomic<int>* next, atomic<bool>* ok){
+	const mzpIndex& v=parent->m_vIndex;
+	int i;
+	while((i=(*next)++)<(int)order->size()){
+		int k=(*order)[i];
+		int p=(*pos)[k];
+		spec=&(*specs)[k];
+		spec->clear();
+		if(p<0 || p>=(int)v.size()){
+			*ok=false;
+			continue;
+		}
+		if(!scanSpectrum(v[p].offset,parent->spectrumSpan(p))) parseOffset(v[p].offset,parent->spectrumSpan(p));
+		if(spec->getScanNum()!=v[p].scanNum) spec->setScanNum(v[p].scanNum);
+		spec->setScanIndex(p+1);
+	}
+	spec=NULL;
+}
+
+//Limits the spectrum arrays that are read to the enumArray bits of mask. The text of
+//other arrays is not kept or decoded. Chromatograms are always read whole.
+void mzpSAXMzmlHandler::setArrays(int mask){
+	m_iArrays=mask;
+}
+
+//Profile spectra are reduced to centroids, and marked as centroided, as they are decoded.
+//Such spectra are then decoded at once, not lazily.
+void mzpSAXMzmlHandler::setCentroiding(bool b){
+	m_bCentroid=b;
+}
+
+void mzpSAXMzmlHandler::setLazyDecode(bool b){
+	m_bLazyDecode=b;
+}
+
+//Keeps only the n most intense peaks of each spectrum, or of each m/z window of the
+//given width, as spectra are decoded. Spectra are then decoded at once, not lazily.
+void mzpSAXMzmlHandler::setTopPeaks(int n, double window){
+	m_topPeaks.topN = n>0 ? n : 0;
+	m_topPeaks.window = window>0 ? window : 0.0;
+}
 
 void mzpSAXMzmlHandler::stopParser(){
 	m_bStopParse=true;
@@ -805,26 +2016,46 @@ void mzpSAXMzmlHandler::stopParser(){
 	m_bInChromatogramList=false;
 	m_bInIndexedMzML=false;
 	m_bInIndexList=false;
+	m_bInChromatogram=false;
 
 	//reset other flags
+	m_bSkipBinary=false;
 	m_bSpectrumIndex=false;
 }
 
+int mzpSAXMzmlHandler::findIdRef(const char* idRef) {
+	unordered_map<const char*,int,mzpStrHash,mzpStrEqual>::iterator it=m_mIdRefPos.find(idRef);
+	if(it==m_mIdRefPos.end()) return -1;
+	return it->second;
+}
+
+int mzpSAXMzmlHandler::findScan(int scanNum) {
+	if(m_vScanPos.size()>0) {
+		if(scanNum<m_iLowScan || scanNum>m_iHighScan) return -1;
+		return m_vScanPos[scanNum-m_iLowScan];
+	}
+	unordered_map<int,int>::iterator it=m_mScanPos.find(scanNum);
+	if(it==m_mScanPos.end()) return -1;
+	return it->second;
+}
+
 int mzpSAXMzmlHandler::highChromat() {
 	return m_vChromatIndex.size();
 }
 
 int mzpSAXMzmlHandler::highScan() {
-	if(m_vIndex.size()==0) return 0;
-	return m_vIndex[m_vIndex.size()-1].scanNum;
+	return m_iHighScan;
 }
 
 int mzpSAXMzmlHandler::lowScan() {
-	if(m_vIndex.size()==0) return 0;
-	return m_vIndex[0].scanNum;
+	return m_iLowScan;
+}
+
+mzpHeaderTable* mzpSAXMzmlHandler::getHeaderTable(){
+	return &m_headerTable;
 }
 
-vector<cindex>* mzpSAXMzmlHandler::getChromatIndex(){
+mzpIndex* mzpSAXMzmlHandler::getChromatIndex(){
 	return &m_vChromatIndex;
 }
 
@@ -840,6 +2071,6 @@ int mzpSAXMzmlHandler::getPeaksCount(){
 	return m_peaksCount;
 }
 
-vector<cindex>* mzpSAXMzmlHandler::getSpecIndex(){
+mzpIndex* mzpSAXMzmlHandler::getSpecIndex(){
 	return &m_vIndex;
 }
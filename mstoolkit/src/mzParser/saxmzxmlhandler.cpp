@@ -28,6 +28,7 @@ mzpSAXMzxmlHandler::mzpSAXMzxmlHandler(BasicSpectrum* bs){
 	m_bInMsRun=false;
 	m_bInIndex=false;
 	m_bInPeaks=false;
+	m_bCentroid=false;
 	m_bCompressedData=false;
 	m_bHeaderOnly=false;
 	m_bLowPrecision=false;
@@ -149,7 +150,7 @@ void mzpSAXMzxmlHandler::startElement(const XML_Char *el, const XML_Char **attr)
 			spec->setMSLevel(atoi(getAttrValue("msLevel", attr)));
 			spec->setBasePeakIntensity(atof(getAttrValue("basePeakIntensity", attr)));
 			spec->setBasePeakMZ(atof(getAttrValue("basePeakMz", attr)));
-			spec->setCentroid((bool)getAttrValue("centroided",attr));
+			spec->setCentroid(atoi(getAttrValue("centroided",attr))!=0);
 			spec->setCollisionEnergy(atof(getAttrValue("collisionEnergy", attr)));
 			spec->setCompensationVoltage(atof(getAttrValue("CompensationVoltage", attr)));
 			s=getAttrValue("filterLine", attr);
@@ -203,10 +204,7 @@ void mzpSAXMzxmlHandler::endElement(const XML_Char *el) {
 		m_vIndex.push_back(curIndex);
 
 	} else if(isElement("peaks",el)){
-		if(m_bLowPrecision && m_bCompressedData) decompress32();
-		else if(m_bLowPrecision && !m_bCompressedData) decode32();
-		else if(!m_bLowPrecision && m_bCompressedData) decompress64();
-		else decode64();
+		decodePeaks();
 		m_bInPeaks = false;
 
 	}	else if(isElement("precursorMz", el)) {
@@ -238,30 +236,26 @@ bool mzpSAXMzxmlHandler::readHeader(int num){
 		posIndex++;
 		if(posIndex>=(int)m_vIndex.size()) return false;
 		m_bHeaderOnly=true;
-		parseOffset(m_vIndex[posIndex].offset);
+		parseOffset(m_vIndex[posIndex].offset,scanSpan(posIndex,true));
 		m_bHeaderOnly=false;
 		return true;
 	}
 
 	//Assumes scan numbers are in order
-	int mid=m_vIndex.size()/2;
-	int upper=m_vIndex.size();
+	int mid=-1;
+	int upper=(int)m_vIndex.size()-1;
 	int lower=0;
-	while(m_vIndex[mid].scanNum!=num){
-		if(lower==upper) break;
-		if(m_vIndex[mid].scanNum>num){
-			upper=mid-1;
-			mid=(lower+upper)/2;
-		} else {
-			lower=mid+1;
-			mid=(lower+upper)/2;
-		}
+	while(lower<=upper){
+		mid=(lower+upper)/2;
+		if(m_vIndex[mid].scanNum==num) break;
+		if(m_vIndex[mid].scanNum>num) upper=mid-1;
+		else lower=mid+1;
 	}
 
 	//need something faster than this, perhaps binary search
-	if(m_vIndex[mid].scanNum==num) {
+	if(mid>=0 && m_vIndex[mid].scanNum==num) {
 		m_bHeaderOnly=true;
-		parseOffset(m_vIndex[mid].offset);
+		parseOffset(m_vIndex[mid].offset,scanSpan(mid,true));
 		//force scan number; this was done for files where scan events are not numbered
 		if(spec->getScanNum()!=m_vIndex[mid].scanNum) spec->setScanNum(m_vIndex[mid].scanNum);
 		spec->setScanIndex(mid+1); //set the index, which starts from 1, so offset by 1
@@ -284,28 +278,24 @@ bool mzpSAXMzxmlHandler::readSpectrum(int num){
 	if(num<0){
 		posIndex++;
 		if(posIndex>=(int)m_vIndex.size()) return false;
-		parseOffset(m_vIndex[posIndex].offset);
+		parseOffset(m_vIndex[posIndex].offset,scanSpan(posIndex));
 		return true;
 	}
 
 	//Assumes scan numbers are in order
-	int mid=m_vIndex.size()/2;
-	int upper=m_vIndex.size();
+	int mid=-1;
+	int upper=(int)m_vIndex.size()-1;
 	int lower=0;
-	while(m_vIndex[mid].scanNum!=num){
-		if(lower==upper) break;
-		if(m_vIndex[mid].scanNum>num){
-			upper=mid-1;
-			mid=(lower+upper)/2;
-		} else {
-			lower=mid+1;
-			mid=(lower+upper)/2;
-		}
+	while(lower<=upper){
+		mid=(lower+upper)/2;
+		if(m_vIndex[mid].scanNum==num) break;
+		if(m_vIndex[mid].scanNum>num) upper=mid-1;
+		else lower=mid+1;
 	}
 
 	//need something faster than this perhaps
-	if(m_vIndex[mid].scanNum==num) {
-		parseOffset(m_vIndex[mid].offset);
+	if(mid>=0 && m_vIndex[mid].scanNum==num) {
+		parseOffset(m_vIndex[mid].offset,scanSpan(mid));
 		//force scan number; this was done for files where scan events are not numbered
 		if(spec->getScanNum()!=m_vIndex[mid].scanNum) spec->setScanNum(m_vIndex[mid].scanNum);
 		spec->setScanIndex(mid+1); //set the index, which starts from 1, so offset by 1
@@ -317,184 +307,144 @@ bool mzpSAXMzxmlHandler::readSpectrum(int num){
 
 void mzpSAXMzxmlHandler::pushSpectrum(){
 
+	if(m_bCentroid && !spec->getCentroid()){
+		m_centroider.centroid(vdM,vdI);
+		spec->setCentroid(true);
+	}
+
+	//TIC, base peak, and m/z extent are gathered as the points are stored, and
+	//describe the whole spectrum even when only the top peaks are kept
+	bool bSelect=m_topPeaks.active();
+	if(bSelect) m_topPeaks.select(vdM,vdI);
 	specDP dp;
+	mzpPeakStats stats;
 	for(unsigned int i=0;i<vdM.size();i++)	{
 		dp.mz = vdM[i];
 		dp.intensity = vdI[i];
+		stats.add(dp.mz,dp.intensity);
+		if(bSelect && !m_topPeaks.keep[i]) continue;
 		spec->addDP(dp);
 	}
+	stats.store(*spec);
 	
 }
 
-void mzpSAXMzxmlHandler::decompress32(){
-
-	vdM.clear();
-	vdI.clear();
-	if(m_peaksCount < 1) return;
-	
-	union udata {
-		float f;
-		uint32_t i;
-	} uData;
-
-	uLong uncomprLen;
-	uint32_t* data;
-	int length;
-	const char* pData = m_strData.data();
-	size_t stringSize = m_strData.size();
-	
-	//Decode base64
-	char* pDecoded = (char*) new char[m_compressLen];
-	memset(pDecoded, 0, m_compressLen);
-	length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-	pData=NULL;
+#ifdef MZP_SSE2
+//Reverses the bytes of each 32-bit lane: bytes within 16-bit words, then the words
+static inline __m128i mzpSwap32(__m128i v){
+	v = _mm_or_si128(_mm_slli_epi16(v,8),_mm_srli_epi16(v,8));
+	v = _mm_shufflelo_epi16(v,_MM_SHUFFLE(2,3,0,1));
+	return _mm_shufflehi_epi16(v,_MM_SHUFFLE(2,3,0,1));
+}
 
-	//zLib decompression
-	data = new uint32_t[m_peaksCount*2];
-	uncomprLen = m_peaksCount * 2 * sizeof(uint32_t);
-	uncompress((Bytef*)data, &uncomprLen, (const Bytef*)pDecoded, length);
-	delete [] pDecoded;
-
-	//write data to arrays
-	int n = 0;
-	for(int i=0;i<m_peaksCount;i++){
-		uData.i = dtohl(data[n++], m_bNetworkData);
-		vdM.push_back((double)uData.f);
-		uData.i = dtohl(data[n++], m_bNetworkData);
-		vdI.push_back((double)uData.f);
-	}
-	delete [] data;
+//Reverses the bytes of each 64-bit lane
+static inline __m128i mzpSwap64(__m128i v){
+	v = _mm_or_si128(_mm_slli_epi16(v,8),_mm_srli_epi16(v,8));
+	v = _mm_shufflelo_epi16(v,_MM_SHUFFLE(0,1,2,3));
+	return _mm_shufflehi_epi16(v,_MM_SHUFFLE(0,1,2,3));
 }
+#endif
 
-void mzpSAXMzxmlHandler::decompress64(){
+//Decodes the <peaks> text into vdM and vdI: base64, then zlib if compressed, then
+//byte order correction and de-interleaving of the m/z-intensity pairs in a single
+//pass. The work buffers and peak vectors keep their memory from scan to scan.
+//Where SSE2 is available, several pairs are swapped and split per step.
+void mzpSAXMzxmlHandler::decodePeaks(){
 
 	vdM.clear();
 	vdI.clear();
 	if(m_peaksCount < 1) return;
-	
-	union udata {
-		double d;
-		uint64_t i;
-	} uData;
-
-	uLong uncomprLen;
-	uint64_t* data;
-	int length;
-	const char* pData = m_strData.data();
-	size_t stringSize = m_strData.size();
-	
-	//Decode base64
-	char* pDecoded = (char*) new char[m_compressLen];
-	memset(pDecoded, 0, m_compressLen);
-	length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-	pData=NULL;
 
-	//zLib decompression
-	data = new uint64_t[m_peaksCount*2];
-	uncomprLen = m_peaksCount * 2 * sizeof(uint64_t);
-	uncompress((Bytef*)data, &uncomprLen, (const Bytef*)pDecoded, length);
-	delete [] pDecoded;
-
-	//write data to arrays
-	int n = 0;
-	for(int i=0;i<m_peaksCount;i++){
-		uData.i = dtohl(data[n++], m_bNetworkData);
-		vdM.push_back(uData.d);
-		uData.i = dtohl(data[n++], m_bNetworkData);
-		vdI.push_back(uData.d);
-	}
-	delete [] data;
+	size_t width = m_bLowPrecision ? sizeof(uint32_t) : sizeof(uint64_t);
+	size_t size = m_peaksCount * 2 * width;
 
-}
-
-
-void mzpSAXMzxmlHandler::decode32(){
-// This code block was revised so that it packs floats correctly
-// on both 64 and 32 bit machines, by making use of the uint32_t
-// data type. -S. Wiley
-	const char* pData = m_strData.data();
+	//Base64 decoding
 	size_t stringSize = m_strData.size();
-	
-	size_t size = m_peaksCount * 2 * sizeof(uint32_t);
-	char* pDecoded = (char *) new char[size];
-	memset(pDecoded, 0, size);
-
-	if(m_peaksCount > 0) {
-		// Base64 decoding
-		// By comparing the size of the unpacked data and the expected size
-		// an additional check of the data file integrity can be performed
-		int length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-		if(length != size) {
-			cout << " decoded size " << length << " and required size " << (unsigned long)size << " dont match:\n";
-			cout << " Cause: possible corrupted file.\n";
-			exit(EXIT_FAILURE);
-		}
+	if(m_vDecoded.size()<stringSize+4) m_vDecoded.resize(stringSize+4);
+	size_t length = b64_decode_mio( &m_vDecoded[0], (char*)m_strData.data(), stringSize );
+	const char* pData = &m_vDecoded[0];
+
+	//zLib decompression
+	if(m_bCompressedData) {
+		if(m_vUnzipped.size()<size) m_vUnzipped.resize(size);
+		uLong uncomprLen = size;
+		uncompress((Bytef*)&m_vUnzipped[0], &uncomprLen, (const Bytef*)pData, length);
+		length = uncomprLen;
+		pData = &m_vUnzipped[0];
+
+	// By comparing the size of the unpacked data and the expected size
+	// an additional check of the data file integrity can be performed
+	} else if(length != size) {
+		cout << " decoded size " << length << " and required size " << (unsigned long)size << " dont match:\n";
+		cout << " Cause: possible corrupted file.\n";
+		exit(EXIT_FAILURE);
 	}
 
 	// And byte order correction
-	union udata {
+	union udata32 {
 		float fData;
 		uint32_t iData;  
-	} uData; 
-
-	vdM.clear();
-	vdI.clear();
-	int n = 0;
-	uint32_t* pDecodedInts = (uint32_t*)pDecoded; // cast to uint_32 for reading int sized chunks
-	for(int i = 0; i < m_peaksCount; i++) {
-		uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-		vdM.push_back((double)uData.fData);
-		uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-		vdI.push_back((double)uData.fData);
-	}
-
-	// Free allocated memory
-	delete[] pDecoded;
-}
+	} uData32; 
 
-void mzpSAXMzxmlHandler::decode64(){
-
-// This code block was revised so that it packs floats correctly
-// on both 64 and 32 bit machines, by making use of the uint32_t
-// data type. -S. Wiley
-	const char* pData = m_strData.data();
-	size_t stringSize = m_strData.size();
-
-	size_t size = m_peaksCount * 2 * sizeof(uint64_t);
-	char* pDecoded = (char *) new char[size];
-	memset(pDecoded, 0, size);
-
-	if(m_peaksCount > 0) {
-		// Base64 decoding
-		// By comparing the size of the unpacked data and the expected size
-		// an additional check of the data file integrity can be performed
-		int length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-		if(length != size) {
-			cout << " decoded size " << length << " and required size " << (unsigned long)size << " dont match:\n";
-			cout << " Cause: possible corrupted file.\n";
-			exit(EXIT_FAILURE);
-		}
-	}
-
-	// And byte order correction
-	union udata {
+	union udata64 {
 		double fData;
 		uint64_t iData;  
-	} uData; 
-
-	vdM.clear();
-	vdI.clear();
-	int n = 0;
-	uint64_t* pDecodedInts = (uint64_t*)pDecoded; // cast to uint_64 for reading int sized chunks
-	for(int i = 0; i < m_peaksCount; i++) {
-		uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-		vdM.push_back(uData.fData);
-		uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-		vdI.push_back(uData.fData);
+	} uData64; 
+
+	size_t n = length/(2*width);
+	if(n>(size_t)m_peaksCount) n=m_peaksCount;
+	vdM.resize(n);
+	vdI.resize(n);
+	size_t i = 0;
+	if(m_bLowPrecision){
+		const uint32_t* pInts = (const uint32_t*)pData; // cast to uint_32 for reading int sized chunks
+#ifdef MZP_SSE2
+		//four pairs at a time: swap, split m/z from intensity, and widen to double
+		bool bSwap = dtohl((uint32_t)1, m_bNetworkData)!=1;
+		for(; i+4 <= n; i+=4) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(pInts+2*i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(pInts+2*i+4));
+			if(bSwap) {
+				a = mzpSwap32(a);
+				b = mzpSwap32(b);
+			}
+			__m128 m = _mm_shuffle_ps(_mm_castsi128_ps(a),_mm_castsi128_ps(b),_MM_SHUFFLE(2,0,2,0));
+			__m128 t = _mm_shuffle_ps(_mm_castsi128_ps(a),_mm_castsi128_ps(b),_MM_SHUFFLE(3,1,3,1));
+			_mm_storeu_pd(&vdM[i],_mm_cvtps_pd(m));
+			_mm_storeu_pd(&vdM[i+2],_mm_cvtps_pd(_mm_movehl_ps(m,m)));
+			_mm_storeu_pd(&vdI[i],_mm_cvtps_pd(t));
+			_mm_storeu_pd(&vdI[i+2],_mm_cvtps_pd(_mm_movehl_ps(t,t)));
+		}
+#endif
+		for(; i < n; i++) {
+			uData32.iData = dtohl(pInts[2*i], m_bNetworkData);
+			vdM[i] = uData32.fData;
+			uData32.iData = dtohl(pInts[2*i+1], m_bNetworkData);
+			vdI[i] = uData32.fData;
+		}
+	} else {
+		const uint64_t* pInts = (const uint64_t*)pData;
+#ifdef MZP_SSE2
+		//two pairs at a time: swap, then split m/z from intensity
+		bool bSwap = dtohl((uint64_t)1, m_bNetworkData)!=1;
+		for(; i+2 <= n; i+=2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(pInts+2*i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(pInts+2*i+2));
+			if(bSwap) {
+				a = mzpSwap64(a);
+				b = mzpSwap64(b);
+			}
+			_mm_storeu_pd(&vdM[i],_mm_unpacklo_pd(_mm_castsi128_pd(a),_mm_castsi128_pd(b)));
+			_mm_storeu_pd(&vdI[i],_mm_unpackhi_pd(_mm_castsi128_pd(a),_mm_castsi128_pd(b)));
+		}
+#endif
+		for(; i < n; i++) {
+			uData64.iData = dtohl(pInts[2*i], m_bNetworkData);
+			vdM[i] = uData64.fData;
+			uData64.iData = dtohl(pInts[2*i+1], m_bNetworkData);
+			vdI[i] = uData64.fData;
+		}
 	}
-
-	// Free allocated memory
-	delete[] pDecoded;
 }
 
 unsigned long mzpSAXMzxmlHandler::dtohl(uint32_t l, bool bNet) {
@@ -538,8 +488,8 @@ uint64_t mzpSAXMzxmlHandler::dtohl(uint64_t l, bool bNet) {
 //tag is placed anywhere other than the end of the mzML file.
 f_off mzpSAXMzxmlHandler::readIndexOffset() {
 
-	char buffer[200];
-	char chunk[CHUNK];
+	char buffer[201];
+	char chunk[CHUNK+1];
 	char* start;
 	char* stop;
 	int readBytes;
@@ -550,15 +500,18 @@ f_off mzpSAXMzxmlHandler::readIndexOffset() {
 		mzpfseek(f,-200,SEEK_END);
 		sz = fread(buffer,1,200,f);
 		fclose(f);
+		buffer[sz]='\0';
 		start=strstr(buffer,"<indexOffset>");
 		stop=strstr(buffer,"</indexOffset>");
 	} else if ( mzgf ) {
-		mzgf->useek( mzgf->filesize()-200 );
-		readBytes = mzgf->read( (unsigned char*)chunk, CHUNK);
+		mzgf->useek( mzgf->ufilesize()-200 );
+		readBytes = (int)mzgf->read( (unsigned char*)chunk, CHUNK);
+		chunk[readBytes>0 ? readBytes : 0]='\0';
 		start=strstr(chunk,"<indexOffset>");
 		stop=strstr(chunk,"</indexOffset>");
 	} else {
 		readBytes = gzObj.extract(fptr, gzObj.getfilesize()-200, (unsigned char*)chunk, CHUNK);
+		chunk[readBytes>0 ? readBytes : 0]='\0';
 		start=strstr(chunk,"<indexOffset>");
 		stop=strstr(chunk,"</indexOffset>");
 	}
@@ -578,17 +531,24 @@ f_off mzpSAXMzxmlHandler::readIndexOffset() {
 
 bool mzpSAXMzxmlHandler::load(const char* fileName){
 	if(!open(fileName)) return false;
-	indexOffset = readIndexOffset();
-	if(indexOffset==0){
-		m_bNoIndex=true;
-		return false;
-	} else {
+	mzpIndex vChromat;	//mzXML has no chromatograms; unused
+	if(readIndexCache(m_vIndex,vChromat,indexOffset)){
 		m_bNoIndex=false;
-		if(!parseOffset(indexOffset)){
-			cerr << "Cannot parse index. Make sure index offset is correct or rebuild index." << endl;
+		posIndex=-1;
+	} else {
+		indexOffset = readIndexOffset();
+		if(indexOffset==0){
+			m_bNoIndex=true;
 			return false;
+		} else {
+			m_bNoIndex=false;
+			if(!parseOffset(indexOffset)){
+				cerr << "Cannot parse index. Make sure index offset is correct or rebuild index." << endl;
+				return false;
+			}
+			posIndex=-1;
 		}
-		posIndex=-1;
+		writeIndexCache(m_vIndex,vChromat,indexOffset);
 	}
 	m_vInstrument.clear();
 	parseOffset(0);
@@ -596,6 +556,26 @@ bool mzpSAXMzxmlHandler::load(const char* fileName){
 }
 
 
+//Length of the scan at index position pos, for sizing its read; the last scan
+//ends at the index. Reads of just the header need no more than one CHUNK.
+int mzpSAXMzxmlHandler::scanSpan(int pos, bool header) const {
+	int len=indexSpan(m_vIndex,pos,indexOffset);
+	if(header && len>CHUNK) len=CHUNK;
+	return len;
+}
+
+//Profile scans are reduced to centroids, and marked as centroided, as they are decoded
+void mzpSAXMzxmlHandler::setCentroiding(bool b){
+	m_bCentroid=b;
+}
+
+//Keeps only the n most intense peaks of each scan, or of each m/z window of the
+//given width, as scans are decoded
+void mzpSAXMzxmlHandler::setTopPeaks(int n, double window){
+	m_topPeaks.topN = n>0 ? n : 0;
+	m_topPeaks.window = window>0 ? window : 0.0;
+}
+
 void mzpSAXMzxmlHandler::stopParser(){
 	m_bStopParse=true;
 	XML_StopParser(m_parser,false);
@@ -624,7 +604,7 @@ int mzpSAXMzxmlHandler::lowScan() {
 	return m_vIndex[0].scanNum;
 }
 
-vector<cindex>* mzpSAXMzxmlHandler::getIndex(){
+mzpIndex* mzpSAXMzxmlHandler::getIndex(){
 	return &m_vIndex;
 }
 
@@ -488,8 +488,11 @@ int MZGFileReader::open( const char *path ) {
       return ret || -1;
    }
 
-   // Read gzip header
-   if ( 0 != (ret = _read_header( extra_mzgf, sizeof(extra_mzgf))) ) return ret;
+   // Read gzip header; a gzip file without the MZGF extra field is plain gzip
+   if ( 0 != (ret = _read_header( extra_mzgf, sizeof(extra_mzgf))) ) {
+      if ( ret == MZGF_BAD_FORMAT ) ret = MZGF_NOT_MZGZIP;
+      return ret;
+   }
    if ( extra_mzgf[0] != 'M' || extra_mzgf[1] != 'Z' ) {
       m_error = "not in MZGF format";
       return MZGF_NOT_MZGZIP;
@@ -535,7 +538,10 @@ ssize_t MZGFileReader::read( unsigned char *data, ssize_t size ) {
                  avail, m_boffset, m_blen );
       if ( avail <= 0 ) {
          if ( -1 == (avail = _read_block()) ) return -1;
-         if ( m_blen == 0 ) break;
+         if ( m_blen == 0 ) {            // nothing inflated yet, e.g. only a block header
+            if ( this->eof() ) break;
+            continue;
+         }
          avail = m_blen - m_boffset;
          if ( m_boffset > m_blen ) {      // outside of block, adjust offset
             m_boffset = m_boffset - m_blen;